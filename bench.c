@@ -0,0 +1,505 @@
+/*
+ * gmenu-bench: headless benchmark for gmenu.
+ *
+ * Starts a private Xvfb, writes synthetic item files, runs gmenu against
+ * each one and drives it with XTest: open the menu, hover every row, open
+ * every submenu, click an item. Timings come from gmenu's own histograms
+ * (stats json over the control socket); startup time and peak RSS are
+ * measured from outside. Every case runs with both the XRender and the
+ * software renderer. Prints one JSON object per case on stdout and,
+ * given a baseline file of the same format, compares against it.
+ *
+ * usage: gmenu-bench [-b baseline.jsonl] [-t tolerance%] [path/to/gmenu]
+ */
+#define _GNU_SOURCE
+#include <X11/Xlib.h>
+#include <X11/extensions/XTest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCREEN_W 1920
+#define SCREEN_H 1200
+#define BORDER_WIDTH 1
+#define HOVER_PACE_US 1000  // Pause after each synthetic motion.
+#define WHEEL_ROWS 3        // Rows gmenu scrolls per wheel click.
+#define TIMEOUT_S 10.0
+
+extern char **environ;
+
+/* The generated menu, kept so the driver knows which rows open submenus. */
+struct Node {
+    int nchildren;
+    struct Node *children;
+};
+
+struct Case {
+    const char *variant;  // plain, color or deep
+    int nitems;
+    const char *renderer; // xrender or software
+};
+
+struct Result {
+    double startup_cold_ms, startup_warm_ms;
+    long peak_rss_kb;
+    int hovers, submenus, scrolls, events;
+    char stats[8192];
+};
+
+static Display *dpy;
+static Window root;
+static pid_t xvfb_pid = -1;
+static char dir[64];  // Scratch HOME for the case being run.
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *msg) {
+    fprintf(stderr, "gmenu-bench: %s\n", msg);
+    if (xvfb_pid > 0)
+        kill(xvfb_pid, SIGTERM);
+    exit(1);
+}
+
+/* Start Xvfb on a free display; -displayfd reports it once the server is ready. */
+static void start_xvfb(void) {
+    int fds[2];
+    if (pipe(fds) < 0)
+        die("pipe failed");
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%dx24", SCREEN_W, SCREEN_H);
+    char *argv[] = { "Xvfb", "-displayfd", fd_arg, "-screen", "0", size, "-nolisten", "tcp", NULL };
+    if (posix_spawnp(&xvfb_pid, "Xvfb", NULL, NULL, argv, environ) != 0)
+        die("cannot run Xvfb");
+    close(fds[1]);
+    char num[16] = {0};
+    if (read(fds[0], num, sizeof(num) - 1) <= 0)
+        die("Xvfb did not start");
+    close(fds[0]);
+    char display[32];
+    snprintf(display, sizeof(display), ":%d", atoi(num));
+    setenv("DISPLAY", display, 1);
+    if (!(dpy = XOpenDisplay(display)))
+        die("cannot open the Xvfb display");
+    int ev, err, major, minor;
+    if (!XTestQueryExtension(dpy, &ev, &err, &major, &minor))
+        die("Xvfb has no XTEST extension");
+    root = DefaultRootWindow(dpy);
+    XSelectInput(dpy, root, SubstructureNotifyMask);
+}
+
+static void label(FILE *f, const char *variant, int depth, int i) {
+    for (int d = 0; d < depth; d++)
+        fputs("==", f);
+    if (strcmp(variant, "color") == 0)
+        fprintf(f, "<color='#%06x'>*</color> Item <color='#338292'>%d</color>", (i * 2654435761u) & 0xffffff, i);
+    else
+        fprintf(f, "Item %d", i);
+}
+
+/* Write the tree in .gmenu_items syntax, one "==" per level of nesting. */
+static void write_node(FILE *f, struct Node *n, const char *variant, int depth, int *counter) {
+    for (int i = 0; i < n->nchildren; i++) {
+        label(f, variant, depth, (*counter)++);
+        if (n->children[i].nchildren > 0) {
+            fputc('\n', f);
+            write_node(f, &n->children[i], variant, depth + 1, counter);
+        } else {
+            fputs(" = true\n", f);
+        }
+    }
+}
+
+/* Flat menus put every item at the top; deep ones nest three levels with an even fanout. */
+static struct Node make_tree(const struct Case *c) {
+    struct Node top = {0};
+    if (strcmp(c->variant, "deep") != 0) {
+        top.nchildren = c->nitems;
+        top.children = calloc(c->nitems, sizeof(struct Node));
+        return top;
+    }
+    int fanout = (int)ceil(cbrt(c->nitems));
+    int left = c->nitems;
+    top.children = calloc(fanout, sizeof(struct Node));
+    for (int i = 0; i < fanout && left > 0; i++) {
+        struct Node *a = &top.children[top.nchildren++];
+        a->children = calloc(fanout, sizeof(struct Node));
+        for (int j = 0; j < fanout && left > 0; j++) {
+            struct Node *b = &a->children[a->nchildren++];
+            b->nchildren = left < fanout ? left : fanout;
+            b->children = calloc(b->nchildren, sizeof(struct Node));
+            left -= b->nchildren;
+        }
+    }
+    return top;
+}
+
+static void free_tree(struct Node *n) {
+    for (int i = 0; i < n->nchildren; i++)
+        free_tree(&n->children[i]);
+    free(n->children);
+}
+
+static void write_case_files(const struct Case *c, struct Node *tree) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/.config", dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/.config/gmenu", dir);
+    mkdir(path, 0700);
+
+    snprintf(path, sizeof(path), "%s/.config/gmenu/.gmenurc", dir);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        die("cannot write .gmenurc");
+    fprintf(f, "font = monospace:size=10\nborder_width = %d\napplications = false\nrenderer = %s\n",
+            BORDER_WIDTH, c->renderer);
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s/.config/gmenu/.gmenu_items", dir);
+    if (!(f = fopen(path, "w")))
+        die("cannot write .gmenu_items");
+    int counter = 0;
+    write_node(f, tree, c->variant, 0, &counter);
+    fclose(f);
+}
+
+/* One control socket exchange; returns the reply length or -1. */
+static int control(const char *cmd, char *reply, size_t size) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/gmenu.sock", dir);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(fd, cmd, strlen(cmd), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len < size - 1 && (n = read(fd, reply + len, size - 1 - len)) > 0)
+        len += n;
+    reply[len] = '\0';
+    close(fd);
+    return len;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st, (void)flag, (void)ftw;
+    return remove(path);
+}
+
+static void stop_gmenu(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* Start gmenu and return once it answers on its control socket. */
+static pid_t start_gmenu(const char *gmenu, double *startup_ms) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/stderr.log", dir);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    char *argv[] = { (char *)gmenu, NULL };
+    pid_t pid;
+    double start = monotonic_now();
+    if (posix_spawn(&pid, gmenu, &actions, NULL, argv, environ) != 0)
+        die("cannot run gmenu");
+    posix_spawn_file_actions_destroy(&actions);
+    char reply[4096];
+    while (control("stats\n", reply, sizeof(reply)) <= 0) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        if (monotonic_now() - start > TIMEOUT_S) {
+            stop_gmenu(pid);
+            return -1;
+        }
+        usleep(1000);
+    }
+    *startup_ms = (monotonic_now() - start) * 1000;
+    return pid;
+}
+
+static long peak_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    long kb = -1;
+    while (f && fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+            break;
+    if (f)
+        fclose(f);
+    return kb;
+}
+
+/* Wait for gmenu to map a menu window and return it, or None after the timeout. */
+static Window wait_for_map(void) {
+    double deadline = monotonic_now() + TIMEOUT_S;
+    int fd = ConnectionNumber(dpy);
+    while (monotonic_now() < deadline) {
+        while (XPending(dpy)) {
+            XEvent ev;
+            XNextEvent(dpy, &ev);
+            if (ev.type == MapNotify && ev.xmap.override_redirect)
+                return ev.xmap.window;
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval tv = { 0, 10000 };
+        select(fd + 1, &fds, NULL, NULL, &tv);
+    }
+    return None;
+}
+
+static void motion(int x, int y, struct Result *r) {
+    XTestFakeMotionEvent(dpy, -1, x, y, CurrentTime);
+    XSync(dpy, False);
+    r->events++;
+    usleep(HOVER_PACE_US);
+}
+
+static void click(int button, struct Result *r) {
+    XTestFakeButtonEvent(dpy, button, True, CurrentTime);
+    XTestFakeButtonEvent(dpy, button, False, CurrentTime);
+    XSync(dpy, False);
+    r->events += 2;
+}
+
+/* Row geometry of a mapped level: rows start below the border, itemheight apart. */
+static int row_y(int wy, int item_height, int row) {
+    return wy + BORDER_WIDTH + row * item_height + item_height / 2;
+}
+
+/*
+ * Hover every visible row of a level and walk into every submenu, then
+ * wheel through the rows of a level too tall for the screen.
+ */
+static void sweep(Window win, struct Node *n, int item_height, struct Result *r) {
+    Window unused;
+    int x, y;
+    unsigned int w, h, bw, depth;
+    XGetGeometry(dpy, win, &unused, &x, &y, &w, &h, &bw, &depth);
+    int visible = (h - 2 * BORDER_WIDTH) / item_height;
+    for (int i = 0; i < n->nchildren && i < visible; i++) {
+        int ry = row_y(y, item_height, i);
+        motion(x + w / 2, ry, r);
+        r->hovers++;
+        if (n->children[i].nchildren > 0) {
+            Window sub = wait_for_map();
+            if (sub == None)
+                continue;
+            r->submenus++;
+            sweep(sub, &n->children[i], item_height, r);
+            motion(x + w / 2, ry, r);  // Back onto the parent row before moving on.
+        }
+    }
+    for (int top = 0; top + visible < n->nchildren; top += WHEEL_ROWS) {
+        click(Button5, r);
+        r->scrolls++;
+        usleep(HOVER_PACE_US);
+    }
+}
+
+/* Pull a number out of a flat stats object, or out of one of its histograms. */
+static double json_number(const char *json, const char *object, const char *key) {
+    char pat[64];
+    if (object) {
+        snprintf(pat, sizeof(pat), "\"%s\": {", object);
+        if (!(json = strstr(json, pat)))
+            return NAN;
+    }
+    snprintf(pat, sizeof(pat), "\"%s\": ", key);
+    const char *p = strstr(json, pat);
+    return p ? strtod(p + strlen(pat), NULL) : NAN;
+}
+
+static int run_case(const char *gmenu, const struct Case *c, struct Result *r) {
+    memset(r, 0, sizeof(*r));
+    snprintf(dir, sizeof(dir), "/tmp/gmenu-bench.XXXXXX");
+    if (!mkdtemp(dir))
+        die("cannot create a scratch directory");
+    setenv("HOME", dir, 1);
+    setenv("XDG_RUNTIME_DIR", dir, 1);
+    setenv("XDG_CACHE_HOME", dir, 1);
+    setenv("XDG_STATE_HOME", dir, 1);
+
+    struct Node tree = make_tree(c);
+    write_case_files(c, &tree);
+
+    // The first start parses and writes the menu cache; the second loads it.
+    pid_t pid = start_gmenu(gmenu, &r->startup_cold_ms);
+    if (pid < 0)
+        goto fail;
+    stop_gmenu(pid);
+    if ((pid = start_gmenu(gmenu, &r->startup_warm_ms)) < 0)
+        goto fail;
+
+    XTestFakeMotionEvent(dpy, -1, 40, 40, CurrentTime);
+    click(Button3, r);
+    Window top = wait_for_map();
+    if (top == None) {
+        stop_gmenu(pid);
+        goto fail;
+    }
+    control("stats json\n", r->stats, sizeof(r->stats));
+    int item_height = json_number(r->stats, NULL, "item_height");
+    if (item_height <= 0) {
+        stop_gmenu(pid);
+        goto fail;
+    }
+    sweep(top, &tree, item_height, r);
+
+    // Click the first leaf: follow the first row down through any submenus.
+    struct Node *n = &tree;
+    Window win = top, unused;
+    int x, y;
+    unsigned int w, h, bw, depth;
+    while (win != None) {
+        XGetGeometry(dpy, win, &unused, &x, &y, &w, &h, &bw, &depth);
+        motion(x + w / 2, row_y(y, item_height, 0), r);
+        if (n->children[0].nchildren == 0) {
+            click(Button1, r);
+            break;
+        }
+        n = &n->children[0];
+        win = wait_for_map();
+    }
+    double deadline = monotonic_now() + TIMEOUT_S;
+    while (control("stats\n", r->stats, sizeof(r->stats)) > 0 && !strstr(r->stats, "\nlaunches 1") &&
+           monotonic_now() < deadline)
+        usleep(1000);
+
+    r->peak_rss_kb = peak_rss_kb(pid);
+    control("stats json\n", r->stats, sizeof(r->stats));
+    stop_gmenu(pid);
+    free_tree(&tree);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+
+fail:
+    free_tree(&tree);
+    return -1;
+}
+
+/* Metrics compared against the baseline; all are lower-is-better. */
+static const char *metrics[] = {
+    "startup_cold_ms", "startup_warm_ms", "show_us", "hover_p50_us", "hover_p99_us",
+    "requests_per_hover", "requests_per_event", "submenu_p50_us", "launch_us", "peak_rss_kb",
+};
+
+static int format_result(char *buf, size_t size, const char *name, const struct Case *c, const struct Result *r) {
+    const char *s = r->stats;
+    return snprintf(buf, size,
+                    "{\"case\": \"%s\", \"items\": %d, \"renderer\": \"%s\", \"startup_cold_ms\": %.2f, \"startup_warm_ms\": %.2f, "
+                    "\"show_us\": %.0f, \"hover_p50_us\": %.0f, \"hover_p99_us\": %.0f, \"hovers\": %d, "
+                    "\"requests_per_hover\": %.2f, \"requests_per_event\": %.2f, \"submenus\": %d, "
+                    "\"scrolls\": %d, \"submenu_p50_us\": %.0f, \"launch_us\": %.0f, \"round_trips\": %.0f, "
+                    "\"peak_rss_kb\": %ld}",
+                    name, c->nitems, c->renderer, r->startup_cold_ms, r->startup_warm_ms,
+                    json_number(s, "show_us", "last"), json_number(s, "hover_us", "p50"),
+                    json_number(s, "hover_us", "p99"), r->hovers,
+                    json_number(s, "hover_requests", "mean"),
+                    json_number(s, NULL, "x_requests") / (r->events ? r->events : 1), r->submenus,
+                    r->scrolls, json_number(s, "submenu_open_us", "p50"), json_number(s, "launch_us", "last"),
+                    json_number(s, NULL, "x_round_trips"), r->peak_rss_kb);
+}
+
+/* Print each metric next to its baseline value; returns the number of regressions. */
+static int compare(const char *baseline, const char *name, const char *result, double tolerance) {
+    FILE *f = fopen(baseline, "r");
+    if (!f)
+        return 0;
+    char line[4096], pat[64];
+    snprintf(pat, sizeof(pat), "\"case\": \"%s\"", name);
+    int regressions = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strstr(line, pat))
+            continue;
+        for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+            double was = json_number(line, NULL, metrics[i]);
+            double now = json_number(result, NULL, metrics[i]);
+            if (isnan(was) || isnan(now) || was <= 0)
+                continue;
+            double change = (now - was) / was * 100;
+            int regressed = change > tolerance;
+            regressions += regressed;
+            fprintf(stderr, "%-12s %-20s %12.2f %12.2f %+7.1f%%%s\n", name, metrics[i], was, now, change,
+                    regressed ? "  REGRESSION" : "");
+        }
+        break;
+    }
+    fclose(f);
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL;
+    double tolerance = 25;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+        if (opt == 'b')
+            baseline = optarg;
+        else if (opt == 't')
+            tolerance = atof(optarg);
+        else {
+            fprintf(stderr, "usage: gmenu-bench [-b baseline.jsonl] [-t tolerance%%] [path/to/gmenu]\n");
+            return 1;
+        }
+    }
+    char gmenu[PATH_MAX];
+    if (!realpath(optind < argc ? argv[optind] : "./gmenu", gmenu))
+        die("gmenu binary not found");
+
+    start_xvfb();
+    const char *variants[] = { "plain", "color", "deep" };
+    const int sizes[] = { 10, 100, 1000, 10000 };
+    const char *renderers[] = { "xrender", "software" };
+    int failures = 0, regressions = 0;
+    // Each variant and size back to back with both renderers, so they can be compared.
+    for (size_t i = 0; i < 3 * 4 * 2; i++) {
+        struct Case c = { variants[i / 8], sizes[i / 2 % 4], renderers[i % 2] };
+        char name[48], out[4096];
+        // XRender cases keep their names so existing baselines still match.
+        snprintf(name, sizeof(name), "%s-%d%s", c.variant, c.nitems, i % 2 ? "-software" : "");
+        static struct Result r;
+        if (run_case(gmenu, &c, &r) < 0) {
+            printf("{\"case\": \"%s\", \"items\": %d, \"error\": \"gmenu did not start or show; see %s/stderr.log\"}\n",
+                   name, c.nitems, dir);
+            failures++;
+            continue;
+        }
+        format_result(out, sizeof(out), name, &c, &r);
+        printf("%s\n", out);
+        fflush(stdout);
+        if (baseline)
+            regressions += compare(baseline, name, out, tolerance);
+    }
+    XCloseDisplay(dpy);
+    kill(xvfb_pid, SIGTERM);
+    waitpid(xvfb_pid, NULL, 0);
+    if (regressions)
+        fprintf(stderr, "gmenu-bench: %d metrics regressed by more than %.0f%%\n", regressions, tolerance);
+    return failures || regressions;
+}
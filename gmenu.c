@@ -1,6 +1,9 @@
+#define _GNU_SOURCE  // POSIX_SPAWN_SETSID, pipe2
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/keysym.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
 #include <X11/Xft/Xft.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,26 +17,59 @@
 #include <sys/select.h>
 #include <limits.h>
 #include <ctype.h>   // For isspace()
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <png.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef GMENU_FUZZ
+#define main gmenu_main  // The parser drivers at the end of the file bring their own.
+#endif
 
-#define MAX_ITEMS 100
-#define MAX_LABEL 256
 #define TERMINAL "alacritty -e"
 #define SUBMENU_INDENT 20
 #define GRACE_PERIOD_SECONDS 0.1
 #define VERTICAL_PADDING 4
-#define MAX_SEGMENTS 10
+#define NO_MATCH INT_MIN
+#define RELOAD_DELAY_SECONDS 0.2
 
-/* Global log file pointer. All log messages will be appended to this file. */
-FILE *log_file = NULL;
+/* Log levels, most severe first; a line is kept if its level is <= config.log_level. */
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+#define LOG_RING_SIZE 1024           // Lines; a power of two.
+#define LOG_LINE_MAX 248
+#define LOG_CRASH_LINES 64           // Lines written out on a fatal signal.
+#define LOG_FLUSH_INTERVAL_MS 100
 
-/* Simple logging macro */
-#define LOG(...) do { \
-    if (log_file) { \
-        fprintf(log_file, __VA_ARGS__); \
-        fprintf(log_file, "\n"); \
-        fflush(log_file); \
-    } \
-} while(0)
+/* Every call takes a subsystem tag, e.g. LOG("menu", "Loaded %d items", n). */
+#define LOG_AT(level, tag, ...) do { \
+    if ((level) <= config.log_level) \
+        log_write(level, tag, __VA_ARGS__); \
+} while (0)
+#define LOG_ERR(tag, ...) LOG_AT(LOG_ERROR, tag, __VA_ARGS__)
+#define LOG_WARNING(tag, ...) LOG_AT(LOG_WARN, tag, __VA_ARGS__)
+#define LOG(tag, ...) LOG_AT(LOG_INFO, tag, __VA_ARGS__)
+#define LOG_DBG(tag, ...) LOG_AT(LOG_DEBUG, tag, __VA_ARGS__)
+
+static void log_write(int level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
 
 struct Config {
     unsigned long fg, bg, selfg, selbg, border_color;
@@ -45,122 +81,1354 @@ struct Config {
     double mouse_delay;
     int icon_left_padding;
     int icon_right_padding;
+    int applications;  // Add an "Applications" submenu from the .desktop files.
+    int recent_items;  // Rows in the "Recent" submenu; 0 hides it.
+    char log_file[PATH_MAX];  // Empty: log lines are only kept for the crash dump.
+    int log_level;
+    int refresh_rate;  // Hover repaints per second at most; 0 paints every event.
+    double pipe_ttl;      // Seconds a pipe menu's output is reused before it is rerun.
+    double pipe_timeout;  // Seconds a pipe menu command may run.
+    char icon_theme[64];  // Looked up before hicolor.
+    char font_fallback[512];  // Comma-separated fonts tried before fontconfig's own list.
+    int renderer;         // RENDER_XRENDER or RENDER_SOFTWARE.
+    int corner_radius;    // Rounds the menu and selection corners; software renderer only.
+    double shadow;        // Opacity of the selection's drop shadow; software renderer only.
 };
 
+enum { RENDER_XRENDER, RENDER_SOFTWARE };
+
 struct LabelSegment {
-    char text[MAX_LABEL];
-    unsigned long color; // e.g. 0xRRGGBB
+    unsigned int text;   // Offset into the string arena.
+    unsigned int len;
+    XftColor xft_color;  // Resolved once in add_run.
+    int x;               // Offset from the start of the label, set by layout_item.
+    unsigned char font;  // Index into fonts, chosen per run by add_segment.
+    unsigned char joined; // Continues the previous segment's text in another font.
 };
 
 struct Item {
-    char label[MAX_LABEL];   // Fallback plain text label.
-    char output[MAX_LABEL];
-    struct LabelSegment segments[MAX_SEGMENTS];
+    unsigned int output;     // Command, as an offset into the string arena.
+    unsigned int output_len;
+    int seg_first;           // First of nsegments entries in model.segments.
     int nsegments;
-    struct Item *submenu;
+    struct Item *submenu;    // Into the next depth's array; fixed up once loading is done.
+    int sub_first;
     int nsubitems;
     int separator;           // 0 = normal, 1 = separator
+    int width;               // Measured label width, set by layout_item.
+    int submenu_width;       // Row width of the submenu, set by layout_submenu.
+    unsigned int submenu_gen; // layout_generation the submenu was measured in.
+    struct Surface *popup;   // Pooled submenu window, created on first hover.
+    int pipe;                // Submenu generated by the command in output: pipes index + 1.
+    unsigned int icon;       // Icon name as an arena offset + 1; 0 for none.
+    int icon_slot;           // Cell in the icon atlas + 1, from icon_register.
+    int store;               // Generated pipe entries: their arena, see item_arena; 0 for the model.
+};
+
+/*
+ * The parsed menu. Strings live in one arena and are referenced by offset;
+ * items, submenu entries and label segments are flat arrays grown as the
+ * item file is read, so memory follows the content and nothing is capped.
+ * Submenu entries are kept in one array per depth; the entries of one
+ * parent are contiguous in it.
+ */
+struct ItemArray {
+    struct Item *v;
+    int n, cap;
+};
+
+struct Model {
+    char *strings;
+    size_t strings_len, strings_cap;
+    struct LabelSegment *segments;
+    int nsegments, segments_cap;
+    struct Item *items;      // Top-level entries.
+    int nitems, items_cap;
+    struct ItemArray *sub;   // sub[d] holds the entries at depth d + 1.
+    int nsub, sub_cap;
+};
+
+/* Where add_line attaches the next entry: the latest item at each depth. */
+struct ParseState {
+    int *path;
+    int depth, cap;
+    const char *file;        // Names the input in diagnostics; NULL keeps quiet.
+    const char *line_start;  // The current line, for error columns.
+    int line;
+    int errors;
+};
+
+/* An input file, mapped when it can be. */
+struct Mapping {
+    const char *data;
+    size_t len;
+    int mapped, owned;
+};
+
+#define MAX_PARSE_ERRORS 20  // Reported per file; the rest are only counted.
+#define MAX_COLOR_DEPTH 8
+
+#define STR(off) (model.strings + (off))
+// Items that may be pipe entries keep their strings and segments elsewhere.
+#define ITEM_STR(item, off) (item_arena(item)->strings + (off))
+#define ITEM_SEG(item, i) (&item_arena(item)->segments[(item)->seg_first + (i)])
+
+/* Colors resolved once after load_config; fills are premultiplied. */
+struct Palette {
+    XRenderColor bg, selbg, separator;
+    XftColor fg, selfg;
+};
+
+/* One open menu: level 0 is the top-level menu, deeper levels cascade from it. */
+struct MenuLevel {
+    struct Item *items;
+    int nitems;
+    struct Surface *surf;
+    int selected;            // Hovered row, or -1.
+    int x, y;                // Root position of the window.
+    int top;                 // First visible row when the level is taller than the screen.
+};
+
+/* One searchable entry: a command item and its lowercased, markup-free label. */
+struct SearchEntry {
+    unsigned int hay;        // Offset into search_hay.
+    unsigned int len;
+    unsigned long long mask; // Characters present in hay, for a cheap prefilter.
+    struct Item *item;
+};
+
+struct SearchMatch {
+    int entry;
+    int score;
+};
+
+/* A menu window and the ARGB back buffer its frames are composed in. */
+struct Surface {
+    Window win;
+    Pixmap buffer;
+    Picture pict;        // Back buffer; all fills and text go here.
+    Picture win_pict;    // Window; only present() touches it.
+    XftDraw *draw;       // Xft drawable for the back buffer.
+    int width, height;
+    int dmg_x0, dmg_y0, dmg_x1, dmg_y1;  // Area drawn but not yet presented.
+    // Software renderer: a client copy of the back buffer, premultiplied ARGB.
+    uint32_t *pixels;
+    int stride;          // In pixels.
+    XImage *image;       // Wraps pixels for the upload.
+    XShmSegmentInfo shm; // shmid is -1 when pixels are ordinary memory.
+    int rst_x0, rst_y0, rst_x1, rst_y1;  // Rasterized but not yet uploaded.
+    unsigned long shm_serial;            // XShmPutImage the server may still be reading, or 0.
 };
 
 Display *dpy;
 int screen;
 Window win;
-Window submenu_win = 0;
 Window root;
 GC gc;
 XftFont *xft_font = NULL;
 XVisualInfo menu_vi;
 Colormap menu_cmap;
-XftDraw *main_draw = NULL;
-XftDraw *submenu_draw = NULL;
-XftColor xft_fg;
-XftColor xft_selfg;
-struct Item items[MAX_ITEMS];
-int nitems = 0;
-int selected_item = -1, selected_subitem = -1;
+XRenderPictFormat *menu_fmt = NULL;
+struct Surface main_surf = {0};
+struct MenuLevel *levels = NULL;  // The open menu stack; levels[0] is the main menu.
+int nlevels = 0, levels_cap = 0;
+int focus_depth = 0;              // Level the keyboard moves in.
+struct Palette palette;
+struct Model model = {0};
+static struct Model *arena = &model;  // Where intern and add_run write; see pipe_parse.
 int menuwidth = 150, itemheight = 16, menuheight = 0;
+
+/* Edge-hover scrolling: while the pointer rests on an edge row, run() keeps scrolling. */
+#define SCROLL_INTERVAL 0.08
+#define WHEEL_ROWS 3
+static int autoscroll_depth = -1;   // Level being scrolled, or -1.
+static int autoscroll_step = 0;
+static double autoscroll_deadline = 0;
+int text_baseline = 0;   // Baseline offset within a row, set by layout_items.
+int arrow_width = 0;
+XftFont *arrow_font = NULL;  // First font in the chain with the arrow glyph.
+int icon_size = 0;       // Icon edge length: the font's ascent + descent.
+unsigned int layout_generation = 0;  // Bumped when the font or items change.
 int max_menuwidth = 150;
-struct Config config = {
-    .fg = 0xFFFFFF,
-    .bg = 0x1A1A1A,
-    .selfg = 0x000000,
-    .selbg = 0xFFD700,
-    .border_color = 0x333333,  // Default border color.
-    .alpha = 0.8,
-    .selalpha = 0.7,          // Could be set differently if you want.
-    .font = "fixed",
-    .border_width = 2,
-    .submenu_offset = 20,
-    .mouse_delay = 0.1,
-    .icon_left_padding = 10,
-    .icon_right_padding = 5
-};
-int menu_x = 0, menu_y = 0;
-int last_selected_item = -1;
+/* The settings before .gmenurc is read, and what a reload starts from. */
+#define CONFIG_DEFAULTS { \
+    .fg = 0xFFFFFF, \
+    .bg = 0x1A1A1A, \
+    .selfg = 0x000000, \
+    .selbg = 0xFFD700, \
+    .border_color = 0x333333, \
+    .alpha = 0.8, \
+    .selalpha = 0.7, \
+    .font = "fixed", \
+    .border_width = 2, \
+    .submenu_offset = 20, \
+    .mouse_delay = 0.1, \
+    .icon_left_padding = 10, \
+    .icon_right_padding = 5, \
+    .recent_items = 8, \
+    .log_level = LOG_INFO, \
+    .refresh_rate = 60, \
+    .pipe_ttl = 30, \
+    .pipe_timeout = 5, \
+    .icon_theme = "hicolor" \
+}
+static const struct Config default_config = CONFIG_DEFAULTS;
+struct Config config = CONFIG_DEFAULTS;
+int rows_repainted = 0;        // Rows painted while handling the current event.
 static struct timeval menu_open_time;
+static int menu_mapped = 0;          // Tracked from our own map/unmap requests.
+
+/*
+ * Frame pacing: hover and keyboard selection draw into the back buffers and
+ * mark a frame pending; run() presents it once the event queue is drained,
+ * at most config.refresh_rate times a second.
+ */
+static int frame_pending = 0;
+static int frame_hover = 0;             // The pending frame moved the hover.
+static double frame_input_time = 0;     // Oldest input waiting in the pending frame.
+static unsigned long frame_requests = 0;
+static double last_frame_time = 0;
+static unsigned long motion_coalesced = 0;
+static unsigned long map_serial = 0; // Request that last mapped the menu.
+static char config_path[PATH_MAX], items_path[PATH_MAX];
+
+/* Live reload: inotify on the config directory, debounced in run(). */
+enum { RELOAD_CONFIG = 1, RELOAD_ITEMS = 2 };
+static int inotify_fd = -1;
+static int reload_pending = 0;      // RELOAD_* bits seen since the last reload.
+static double reload_deadline = 0;
+static struct Surface **spare_popups = NULL;  // Unused submenu windows kept for reuse.
+static int nspare_popups = 0, spare_popups_cap = 0;
+static struct Item *menu_root = NULL;  // Submenu shown as the top level, NULL for the whole menu.
+
+/* Control socket and the counters it reports. */
+static int control_fd = -1;
+struct ControlClient {       // A connection whose command line has not fully arrived.
+    int fd;
+    size_t len;
+    double deadline;
+    char line[512];
+};
+#define MAX_CONTROL_CLIENTS 8
+#define CONTROL_TIMEOUT 1.0  // Seconds a client may take to send its line.
+static struct ControlClient control_clients[MAX_CONTROL_CLIENTS];
+static int ncontrol_clients = 0;
+static double start_time;
+static int nshows = 0, nreloads = 0;
+static int nlaunches = 0;
+static int pipe_runs = 0, pipe_timeouts = 0;  // Pipe menu commands started and killed.
+static int icons_found = 0, icons_missing = 0;  // In the current icon atlas.
+static char **icon_names = NULL;  // Registered by parse_label, in atlas slot order.
+static int nicon_names = 0, icon_names_cap = 0;
+static int parse_errors = 0;  // Malformed entries in the last parse of the items file.
+static double input_time = 0;      // When the event being handled was read.
+static int wake_pipe[2] = { -1, -1 };  // Written by signal handlers to wake run().
+static volatile sig_atomic_t stats_requested = 0;
+
+/* Hot-path instrumentation, reported by --stats and SIGUSR1. */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define ROUND_TRIP(call) (x_round_trips++, (call))  // Marks a call that waits for the server.
+
+struct Histogram {
+    const char *name;
+    unsigned long long count, sum, min, max, last;
+    unsigned int buckets[HIST_BUCKETS];
+};
+
+static struct Histogram hist_show = { "show_us" };          // Button press or --show to painted menu.
+static struct Histogram hist_hover = { "hover_us" };        // MotionNotify to repainted row.
+static struct Histogram hist_hover_requests = { "hover_requests" };  // X requests per repainting motion.
+static struct Histogram hist_submenu = { "submenu_open_us" };
+static struct Histogram hist_launch = { "launch_us" };      // Click or key press to exec.
+static struct Histogram *histograms[] = {
+    &hist_show, &hist_hover, &hist_hover_requests, &hist_submenu, &hist_launch
+};
+static unsigned long x_round_trips = 0;
+
+/* Log ring, see log_write. */
+struct LogSlot {
+    unsigned short len;
+    char line[LOG_LINE_MAX];
+};
+static struct LogSlot log_ring[LOG_RING_SIZE];
+static unsigned long log_head = 0;     // Next slot to fill; advanced by the event thread.
+static unsigned long log_tail = 0;     // Next slot to write out; advanced by the writer.
+static unsigned long log_dropped = 0;
+static double log_epoch;
+static int log_sink_fd = -1;
+static int log_stop = 0;
+static int log_thread_running = 0;
+static pthread_t log_thread;
+static pthread_mutex_t log_sink_lock = PTHREAD_MUTEX_INITIALIZER;  // Held by the writer while it writes.
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+/* Launch history and the "Recent" submenu built from it. */
+static struct Usage *usage = NULL;
+static int nusage = 0, usage_cap = 0;   // usage_cap is a power of two.
+static char usage_path[PATH_MAX + 16];
+static int usage_fd = -1;
+static struct Item *recent_items = NULL;  // Children of the "Recent" item.
+static int nrecent = 0, recent_cap = 0;
+static int recent_rows = 0;               // 2 while "Recent" and a separator head the menu.
+static int recent_dirty = 0;              // A launch changed the scores.
+static struct Item *recent_label = NULL;  // Label of "Recent", parsed into the current model.
+static double load_started = 0, last_load_ms = 0;  // Item file to measured top level.
+static int last_load_cached = 0;
+
+/* Compiled menu cache; see load_menu_cache. */
+static uint64_t menu_cache_key;
+static int model_from_cache = 0;   // Model came from the cache and is already measured.
+static int menu_cache_stale = 0;   // Model was parsed; write the cache once it is measured.
+
+/*
+ * Type-to-filter. The index is built on the first keystroke after a load;
+ * matches holds the result set for query, which is narrowed in place when
+ * a character is appended. While a query is active, level 0 shows copies
+ * of the matching items from results.
+ */
+static struct SearchEntry *search_index = NULL;
+static int nsearch = -1, search_cap = 0;   // nsearch < 0: index not built.
+static char *search_hay = NULL;            // The lowercased labels the index points into.
+static size_t search_hay_len = 0, search_hay_cap = 0;
+static struct SearchMatch *matches = NULL;
+static int nmatches = 0, matches_cap = 0;
+static struct Item *results = NULL;
+static int results_cap = 0;
+static char query[256];
+static int query_len = 0;
 
 /* Function declarations */
 static void setup(void);
+static void setup_visual(void);
+static void setup_palette(void);
+static XRenderColor render_color(unsigned long rgb, double alpha);
 static void read_input(const char *path);
 static void drawmenu(void);
-static void draw_item(Window w, int x, int y, int width, struct Item *item, int selected);
-static void draw_submenu(struct Item *parent);
+static void draw_item(struct Surface *s, int x, int y, int width, struct Item *item, int selected);
+static void draw_item_background(struct Surface *s, int x, int y, int width, struct Item *item, int selected);
+static void draw_item_text(struct Surface *s, int x, int y, int width, struct Item *item, int selected);
+static void paint_fill(struct Surface *s, const XRenderColor *c, int x, int y, int width, int height);
+static void raster_alloc(struct Surface *s);
+static void raster_free(struct Surface *s);
+static void raster_flush(struct Surface *s);
+static void draw_level(struct MenuLevel *l);
+static void draw_row(struct MenuLevel *l, int i);
+static void surface_init(struct Surface *s, Window w, int width, int height);
+static void surface_free(struct Surface *s);
+static void damage(struct Surface *s, int x, int y, int width, int height);
+static void present(struct Surface *s);
+static void discard_damage(struct Surface *s);
+static struct MenuLevel *level_of(Window w);
+static int row_at(struct MenuLevel *l, int y);
+static void select_row(int depth, int i);
+static int visible_rows(struct MenuLevel *l);
+static int capped_rows(int n);
+static int scroll_into_view(struct MenuLevel *l, int row);
+static void scroll_level(int depth, int delta);
+static void update_autoscroll(int depth, int row);
+static void open_submenu(int depth);
+static void close_levels(int depth);
+static void hide_menu(void);
+static void handle_key(XKeyEvent *ev);
+static void move_selection(int step);
+static void activate_row(void);
+static void build_search_index(void);
+static void free_search_index(void);
+static void apply_filter(int narrow);
+static void clear_filter(void);
+static void fit_main_window(int width, int rows);
 static void handle_event(XEvent *ev);
 static void load_config(const char *path);
 static void load_font(void);
 static void cleanup(void);
-static void show_menu(int x, int y);
-static int text_width(const char *text);
+static void show_menu(int x, int y, struct Item *menu);
+static void reset_top_level(void);
+static int text_width(XftFont *font, const char *text, int len);
+static XftFont *font_at(int index);
+static int font_for(FcChar32 c);
+static void font_add(XftFont *font, FcPattern *pattern, FcCharSet *charset);
+static void free_fonts(void);
 static void execute_command(const char *cmd);
+static void setup_child_reaping(void);
+static void reap_children(void);
+static void hist_add(struct Histogram *h, uint64_t v);
+static void hist_time(struct Histogram *h, double start);
+static size_t format_stats(char *buf, size_t size, int json);
+static void dump_stats(void);
 static void calculate_menu_width(void);
 static int calculate_submenu_width(struct Item *parent);
-static void create_submenu_window(struct Item *parent, int x, int y);
-static void destroy_submenu_window(void);
+static void layout_item(struct Item *item);
+static void layout_items(void);
+static void layout_submenu(struct Item *parent);
+static struct Surface *submenu_surface(struct Item *parent);
+static void free_submenu_windows(void);
+static void release_submenu_windows(void);
+static void prepaint_popup(struct Item *parent);
+static void surface_resize(struct Surface *s, int width, int height);
+static void watch_config(void);
+static void read_inotify(void);
+static void reload(int what);
+static void control_listen(void);
+static void control_accept(void);
+static void control_select(fd_set *fds, int *maxfd, double *wait);
+static void control_poll(fd_set *fds);
+static int control_client(int argc, char *argv[]);
+static void run(void);
+static double monotonic_now(void);
 static void regrab_button(void);
 static int is_menu_mapped(void);
-static void parse_label(const char *input, struct LabelSegment segments[], int *nsegments);
+static void parse_label(const char *text, size_t len, struct Item *item, struct ParseState *ps);
+static void parse_error(struct ParseState *ps, const char *at, const char *fmt, ...);
+static void add_line(const char *line, size_t len, struct ParseState *ps);
+static void parse_items(const char *buf, size_t len, struct ParseState *ps);
+static int map_file(const char *path, struct Mapping *m);
+static void unmap_file(struct Mapping *m);
+static void add_item(struct Item *item, int depth, struct ParseState *ps);
+static void read_applications(struct ParseState *ps);
+static struct Item *item_at(int depth, int index);
+static struct Model *item_arena(const struct Item *item);
+static void free_model(void);
+static void log_init(void);
+static void log_open(const char *path);
+static void log_shutdown(void);
+static void usage_load(void);
+static void usage_record(const char *cmd);
+static void update_recent_menu(void);
+static void fixup_submenus(void);
+static void pipe_attach(void);
+static void pipe_detach(void);
+static void pipe_opened(struct Item *parent);
+static void pipe_select(fd_set *fds, int *maxfd, double *wait);
+static void pipe_poll(fd_set *fds);
+static void free_pipes(void);
+static uint64_t menu_cache_hash(const char *items, size_t len);
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+static int load_menu_cache(uint64_t key);
+static void save_menu_cache(uint64_t key);
+static int write_atomically(const char *path, const void *data, size_t size);
+static int icon_register(const char *name);
+static void icons_attach(void);
+static void icons_load(void);
+static void icons_poll(void);
+static void repaint_icon_popups(void);
+static void free_icons(void);
 
-/* New helper function: measure total text width of an Item by summing all segments */
-static int item_text_width(struct Item *item) {
-    if (item->nsegments > 0) {
-        int total_width = 0;
-        for (int i = 0; i < item->nsegments; i++) {
-            total_width += text_width(item->segments[i].text);
+/* Measure an item once: segment offsets and the total width are cached on it. */
+static void layout_item(struct Item *item) {
+    int total_width = item->icon ? icon_size + config.icon_right_padding : 0;
+    for (int i = 0; i < item->nsegments; i++) {
+        struct LabelSegment *seg = ITEM_SEG(item, i);
+        seg->x = total_width;
+        total_width += text_width(font_at(seg->font), ITEM_STR(item, seg->text), seg->len);
+    }
+    item->width = total_width;
+}
+
+/*
+ * Compute the measurements the paint path needs for the top level. Must be
+ * rerun whenever the font or the items change; bumping layout_generation
+ * invalidates every submenu, which layout_submenu measures on first open.
+ * draw_item itself never measures text.
+ */
+static void layout_items(void) {
+    layout_generation++;
+    text_baseline = (itemheight + xft_font->ascent - xft_font->descent) / 2;
+    arrow_font = font_at(font_for(0x25B6));
+    arrow_width = text_width(arrow_font, "▶", strlen("▶"));
+    // Open the fallback fonts the labels use now rather than on first paint.
+    for (int i = 0; i < model.nsegments; i++)
+        font_at(model.segments[i].font);
+    if (model_from_cache) {
+        // Labels were measured in the cache; submenu rows still depend on the padding.
+        for (int d = 0; d < model.nsub; d++) {
+            int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+            for (int i = 0; i < n; i++) {
+                struct Item *it = item_at(d, i);
+                // Pipe entries are rebuilt from the output, unmeasured.
+                if (it->nsubitems > 0 && !it->pipe) {
+                    it->submenu_width = calculate_submenu_width(it);
+                    it->submenu_gen = layout_generation;
+                }
+            }
         }
-        return total_width;
+        model_from_cache = 0;
     } else {
-        return text_width(item->label);
+        for (int i = 0; i < model.nitems; i++)
+            layout_item(&model.items[i]);
+    }
+    calculate_menu_width();
+    if (load_started > 0) {
+        last_load_ms = (monotonic_now() - load_started) * 1000;
+        load_started = 0;
+        LOG("menu", "Menu loaded in %.2f ms (%s)", last_load_ms, last_load_cached ? "cache" : "parsed");
+    }
+    if (menu_cache_stale) {
+        save_menu_cache(menu_cache_key);
+        menu_cache_stale = 0;
     }
+    icons_load();
+}
+
+static void layout_submenu(struct Item *parent) {
+    if (parent->submenu_gen == layout_generation)
+        return;
+    for (int i = 0; i < parent->nsubitems; i++)
+        layout_item(&parent->submenu[i]);
+    parent->submenu_width = calculate_submenu_width(parent);
+    parent->submenu_gen = layout_generation;
 }
 
 int main(int argc, char *argv[]) {
+    if (argc > 1)
+        return control_client(argc, argv);
+    start_time = monotonic_now();
+    log_init();
+    control_listen();
     if (!(dpy = XOpenDisplay(NULL))) {
         fprintf(stderr, "gmenu: cannot open display\n");
         exit(1);
     }
+    // Launched programs must not inherit the X connection.
+    fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC);
+    setup_child_reaping();
     screen = DefaultScreen(dpy);
     root = RootWindow(dpy, screen);
 
     const char *home = getenv("HOME");
-    char config_path[256], items_path[256];
     snprintf(config_path, sizeof(config_path), "%s/.config/gmenu/.gmenurc", home);
     snprintf(items_path, sizeof(items_path), "%s/.config/gmenu/.gmenu_items", home);
     load_config(config_path);
+    log_open(config.log_file);
+    setup_visual();
+    setup_palette();
 
     load_font();
+    usage_load();
     read_input(items_path);
-    calculate_menu_width();
+    layout_items();
+    update_recent_menu();
     setup();
     regrab_button();
+    watch_config();
 
-    XEvent ev;
-    while (!XNextEvent(dpy, &ev))
-        handle_event(&ev);
+    run();
 
     cleanup();
     return 0;
 }
 
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Logging. LOG and friends format one line straight into a slot of a
+ * single-producer ring (only the event thread logs) and return; a writer
+ * thread drains the ring in batches to the file named by log_file, or
+ * drops the lines if there is none. A full ring drops new lines rather
+ * than block. The ring keeps the latest lines around for the crash dump.
+ */
+static void log_write(int level, const char *tag, const char *fmt, ...) {
+    unsigned long head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    unsigned long queued = head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+    if (queued >= LOG_RING_SIZE) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (queued == LOG_RING_SIZE / 2)
+        pthread_cond_signal(&log_wake);  // a burst: don't wait for the next flush
+    struct LogSlot *slot = &log_ring[head & (LOG_RING_SIZE - 1)];
+    int n = snprintf(slot->line, LOG_LINE_MAX, "[%10.3f] %c %-7s ",
+                     monotonic_now() - log_epoch, "EWID"[level], tag);
+    va_list args;
+    va_start(args, fmt);
+    int m = vsnprintf(slot->line + n, LOG_LINE_MAX - n, fmt, args);
+    va_end(args);
+    n = m < 0 ? n : n + m < LOG_LINE_MAX - 1 ? n + m : LOG_LINE_MAX - 1;
+    slot->line[n++] = '\n';
+    slot->len = n;
+    __atomic_store_n(&log_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *log_writer(void *arg) {
+    static char batch[64 * 1024];
+    unsigned long reported = 0;
+    (void)arg;
+    for (;;) {
+        int stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+        unsigned long head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+        unsigned long tail = log_tail;
+        pthread_mutex_lock(&log_sink_lock);
+        while (tail != head) {
+            size_t len = 0;
+            for (; tail != head && len + LOG_LINE_MAX <= sizeof(batch); tail++) {
+                struct LogSlot *slot = &log_ring[tail & (LOG_RING_SIZE - 1)];
+                memcpy(batch + len, slot->line, slot->len);
+                len += slot->len;
+            }
+            __atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+            if (log_sink_fd >= 0)
+                write_all(log_sink_fd, batch, len);
+        }
+        unsigned long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported && log_sink_fd >= 0) {
+            int len = snprintf(batch, sizeof(batch), "[%10.3f] W log     %lu lines dropped\n",
+                               monotonic_now() - log_epoch, dropped - reported);
+            write_all(log_sink_fd, batch, len);
+            reported = dropped;
+        }
+        pthread_mutex_unlock(&log_sink_lock);
+        if (stop)
+            return NULL;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_timedwait(&log_wake, &log_wake_lock, &ts);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+}
+
+/* Write the last lines to stderr and the log file, then die of the same signal. */
+static void log_crash(int sig) {
+    static const char header[] = "gmenu: fatal signal, last log lines:\n";
+    int fds[2] = { STDERR_FILENO, log_sink_fd };
+    unsigned long head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > LOG_CRASH_LINES ? head - LOG_CRASH_LINES : 0;
+    for (int f = 0; f < 2; f++) {
+        if (fds[f] < 0)
+            continue;
+        write_all(fds[f], header, sizeof(header) - 1);
+        for (unsigned long i = first; i < head; i++) {
+            struct LogSlot *slot = &log_ring[i & (LOG_RING_SIZE - 1)];
+            write_all(fds[f], slot->line, slot->len);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void log_init(void) {
+    log_epoch = monotonic_now();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_crash;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+        sigaction(fatal[i], &sa, NULL);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0)
+        fprintf(stderr, "gmenu: cannot start the log writer\n");
+    else
+        log_thread_running = 1;
+}
+
+/* Point the writer at path ("" for none); "~/" is relative to $HOME. */
+static void log_open(const char *path) {
+    char full[PATH_MAX];
+    int len;
+    if (strncmp(path, "~/", 2) == 0)
+        len = snprintf(full, sizeof(full), "%s/%s", getenv("HOME"), path + 2);
+    else
+        len = snprintf(full, sizeof(full), "%s", path);
+    if (len >= (int)sizeof(full)) {
+        fprintf(stderr, "gmenu: log file path too long\n");
+        full[0] = '\0';
+    }
+    int fd = -1;
+    if (*full && (fd = open(full, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        fprintf(stderr, "gmenu: cannot open log file %s: %s\n", full, strerror(errno));
+    pthread_mutex_lock(&log_sink_lock);
+    if (log_sink_fd >= 0)
+        close(log_sink_fd);
+    log_sink_fd = fd;
+    pthread_mutex_unlock(&log_sink_lock);
+    if (fd >= 0) {
+        time_t now = time(NULL);
+        char date[64];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        LOG("log", "gmenu %d logging since %s", (int)getpid(), date);
+    }
+}
+
+static void log_shutdown(void) {
+    if (!log_thread_running)
+        return;
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_wake);
+    pthread_join(log_thread, NULL);
+    log_thread_running = 0;
+}
+
+/*
+ * Event loop. X events are handled as they arrive; file changes are
+ * collected from inotify and applied once writes have settled for
+ * RELOAD_DELAY_SECONDS and the menu is closed.
+ */
+/* Show everything drawn since the last frame. */
+static void present_frame(void) {
+    frame_pending = 0;
+    if (!menu_mapped) {
+        frame_hover = 0;
+        return;  // show_menu presents the whole menu anyway.
+    }
+    for (int i = 0; i < nlevels; i++)
+        present(levels[i].surf);
+    XFlush(dpy);
+    last_frame_time = monotonic_now();
+    if (frame_hover) {
+        hist_time(&hist_hover, frame_input_time);
+        hist_add(&hist_hover_requests, NextRequest(dpy) - frame_requests);
+        frame_hover = 0;
+    }
+}
+
+static void run(void) {
+    XEvent ev;
+    int xfd = ConnectionNumber(dpy);
+
+    for (;;) {
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            handle_event(&ev);
+        }
+        icons_poll();
+
+        struct timeval tv, *timeout = NULL;
+        double wait = -1;
+        if (autoscroll_depth >= 0) {
+            double scroll_wait = autoscroll_deadline - monotonic_now();
+            if (scroll_wait <= 0) {
+                // Scroll one row and keep the edge row under the pointer selected.
+                struct MenuLevel *l = &levels[autoscroll_depth];
+                scroll_level(autoscroll_depth, autoscroll_step);
+                int edge = autoscroll_step < 0 ? l->top : l->top + visible_rows(l) - 1;
+                if (edge != l->selected)
+                    select_row(autoscroll_depth, edge);
+                update_autoscroll(autoscroll_depth, edge);
+                autoscroll_deadline = monotonic_now() + SCROLL_INTERVAL;
+                scroll_wait = SCROLL_INTERVAL;
+            }
+            if (autoscroll_depth >= 0)
+                wait = scroll_wait;
+        }
+        if (frame_pending) {
+            double interval = config.refresh_rate > 0 ? 1.0 / config.refresh_rate : 0;
+            double frame_wait = last_frame_time + interval - monotonic_now();
+            if (frame_wait <= 0)
+                present_frame();
+            else if (wait < 0 || frame_wait < wait)
+                wait = frame_wait;
+        }
+        if (reload_pending) {
+            double reload_wait = reload_deadline - monotonic_now();
+            if (reload_wait <= 0 && !is_menu_mapped()) {
+                reload(reload_pending);
+                reload_pending = 0;
+                continue;
+            }
+            if (reload_wait > 0 && (wait < 0 || reload_wait < wait))
+                wait = reload_wait;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(xfd, &fds);
+        if (inotify_fd >= 0)
+            FD_SET(inotify_fd, &fds);
+        if (wake_pipe[0] >= 0)
+            FD_SET(wake_pipe[0], &fds);
+        int maxfd = xfd > inotify_fd ? xfd : inotify_fd;
+        if (wake_pipe[0] > maxfd)
+            maxfd = wake_pipe[0];
+        pipe_select(&fds, &maxfd, &wait);
+        control_select(&fds, &maxfd, &wait);
+        if (wait > 0) {
+            tv.tv_sec = (time_t)wait;
+            tv.tv_usec = (wait - tv.tv_sec) * 1000000;
+            timeout = &tv;
+        }
+        if (select(maxfd + 1, &fds, NULL, NULL, timeout) < 0)
+            continue;
+        pipe_poll(&fds);
+        if (inotify_fd >= 0 && FD_ISSET(inotify_fd, &fds))
+            read_inotify();
+        control_poll(&fds);
+        if (wake_pipe[0] >= 0 && FD_ISSET(wake_pipe[0], &fds)) {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            reap_children();
+            if (stats_requested) {
+                stats_requested = 0;
+                dump_stats();
+            }
+        }
+    }
+}
+
+/*
+ * Watch the directories holding .gmenurc and .gmenu_items rather than the
+ * files, so writers that replace the file by rename are seen too.
+ */
+static void watch_config(void) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        LOG_WARNING("reload", "inotify unavailable, live reload disabled");
+        return;
+    }
+    const char *paths[] = { config_path, items_path };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", paths[i]);
+        char *slash = strrchr(dir, '/');
+        if (!slash)
+            continue;
+        *slash = '\0';
+        if (inotify_add_watch(inotify_fd, dir,
+                              IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0)
+            LOG_WARNING("reload", "Cannot watch %s", dir);
+    }
+}
+
+static void read_inotify(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *config_name = strrchr(config_path, '/') + 1;
+    const char *items_name = strrchr(items_path, '/') + 1;
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            if (e->len) {
+                if (strcmp(e->name, config_name) == 0)
+                    reload_pending |= RELOAD_CONFIG;
+                else if (strcmp(e->name, items_name) == 0)
+                    reload_pending |= RELOAD_ITEMS;
+            }
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+    if (reload_pending)
+        reload_deadline = monotonic_now() + RELOAD_DELAY_SECONDS;
+}
+
+/*
+ * Control socket. A running gmenu listens on a Unix socket so that
+ * "gmenu --show", "--reload" and "--stats" can drive it from scripts and
+ * window manager bindings. Each connection carries one command line and
+ * gets a reply, after which the daemon closes it.
+ */
+/*
+ * Path of the control socket; -1 if it would not be private. Without
+ * XDG_RUNTIME_DIR it lives in /tmp/gmenu-<uid>, which must be a directory
+ * only we can enter, so nobody else can plant a socket there first.
+ */
+static int control_socket_path(struct sockaddr_un *addr) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (dir && *dir) {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%.*s/gmenu.sock",
+                 (int)sizeof(addr->sun_path) - 12, dir);
+        return 0;
+    }
+    char tmp[64];
+    struct stat st;
+    snprintf(tmp, sizeof(tmp), "/tmp/gmenu-%d", (int)getuid());
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/gmenu.sock", tmp);
+    mkdir(tmp, 0700);
+    if (lstat(tmp, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        LOG_WARNING("ctl", "%s is not a private directory; not using it for the control socket", tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void control_listen(void) {
+    struct sockaddr_un addr;
+    if (control_socket_path(&addr) < 0)
+        return;
+
+    // A socket that still accepts connections belongs to a live instance.
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "gmenu: already running (%s)\n", addr.sun_path);
+        exit(1);
+    }
+    if (probe >= 0)
+        close(probe);
+    unlink(addr.sun_path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077);
+    if (control_fd < 0 || bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(control_fd, 8) < 0) {
+        LOG_WARNING("ctl", "Control socket %s unavailable", addr.sun_path);
+        if (control_fd >= 0)
+            close(control_fd);
+        control_fd = -1;
+    }
+    umask(old_mask);
+}
+
+static void control_reply(int fd, const char *fmt, ...) {
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    send(fd, buf, len, MSG_NOSIGNAL);  // the client may be gone already
+}
+
+/* Find a submenu by its label path, e.g. "Applications/Games"; NULL if there is none. */
+static struct Item *find_menu(const char *name) {
+    struct Item *items = model.items, *found = NULL;
+    int n = model.nitems;
+    char path[256];
+    snprintf(path, sizeof(path), "%s", name);
+    for (char *save, *part = strtok_r(path, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        found = NULL;
+        for (int i = 0; i < n && !found; i++) {
+            struct Item *it = &items[i];
+            if (it->nsubitems == 0)
+                continue;
+            // Compare against the label text without its color markup.
+            char label[256];
+            size_t len = 0;
+            for (int k = 0; k < it->nsegments && len < sizeof(label) - 1; k++) {
+                struct LabelSegment *seg = ITEM_SEG(it, k);
+                len += snprintf(label + len, sizeof(label) - len, "%s%s",
+                                k && !seg->joined ? " " : "", ITEM_STR(it, seg->text));
+            }
+            if (strcasecmp(label, part) == 0)
+                found = it;
+        }
+        if (!found)
+            return NULL;
+        items = found->submenu;
+        n = found->nsubitems;
+    }
+    return found;
+}
+
+static void control_command(int fd, char *line) {
+    double start = monotonic_now();
+    char *save, *cmd = strtok_r(line, " \t", &save);
+
+    if (cmd && strcmp(cmd, "show") == 0) {
+        char *arg, *menu = NULL, *end;
+        int coords[2], ncoords = 0;
+        while ((arg = strtok_r(NULL, " \t", &save))) {
+            if (strcmp(arg, "menu") == 0) {
+                menu = save;  // the rest of the line is the name
+                break;
+            }
+            long v = strtol(arg, &end, 10);
+            if (*end || ncoords == 2) {
+                control_reply(fd, "error: bad argument '%s'\n", arg);
+                return;
+            }
+            coords[ncoords++] = v;
+        }
+        struct Item *target = NULL;
+        while (menu && isspace((unsigned char)*menu))
+            menu++;
+        if (menu && *menu && !(target = find_menu(menu))) {
+            control_reply(fd, "error: no menu '%s'\n", menu);
+            return;
+        }
+        if (ncoords < 2) {
+            Window r, c;
+            int wx, wy;
+            unsigned int mask;
+            ROUND_TRIP(XQueryPointer(dpy, root, &r, &c, &coords[0], &coords[1], &wx, &wy, &mask));
+        }
+        if (is_menu_mapped())
+            hide_menu();
+        input_time = start;
+        show_menu(coords[0], coords[1], target);
+        LOG("ctl", "Shown from the control socket in %.2f ms", hist_show.last / 1000.0);
+        control_reply(fd, "ok\n");
+    } else if (cmd && strcmp(cmd, "reload") == 0) {
+        // Applied by run() as soon as the menu is closed.
+        reload_pending |= RELOAD_CONFIG | RELOAD_ITEMS;
+        reload_deadline = monotonic_now();
+        control_reply(fd, "ok\n");
+    } else if (cmd && strcmp(cmd, "stats") == 0) {
+        char *arg = strtok_r(NULL, " \t", &save);
+        static char buf[8192];
+        size_t len = format_stats(buf, sizeof(buf), arg && strcmp(arg, "json") == 0);
+        send(fd, buf, len, MSG_NOSIGNAL);
+    } else {
+        control_reply(fd, "error: unknown command '%s'\n", cmd ? cmd : "");
+    }
+}
+
+/* Take new connections; their lines are read without blocking by control_poll. */
+static void control_accept(void) {
+    while (ncontrol_clients < MAX_CONTROL_CLIENTS) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct ControlClient *c = &control_clients[ncontrol_clients++];
+        c->fd = fd;
+        c->len = 0;
+        c->deadline = monotonic_now() + CONTROL_TIMEOUT;
+    }
+}
+
+/* Add the listening socket and the clients still sending to run()'s select set. */
+static void control_select(fd_set *fds, int *maxfd, double *wait) {
+    if (control_fd >= 0 && ncontrol_clients < MAX_CONTROL_CLIENTS) {
+        FD_SET(control_fd, fds);
+        if (control_fd > *maxfd)
+            *maxfd = control_fd;
+    }
+    double now = monotonic_now();
+    for (int i = 0; i < ncontrol_clients; i++) {
+        FD_SET(control_clients[i].fd, fds);
+        if (control_clients[i].fd > *maxfd)
+            *maxfd = control_clients[i].fd;
+        double left = control_clients[i].deadline - now;
+        if (left < 0.001)
+            left = 0.001;
+        if (*wait < 0 || left < *wait)
+            *wait = left;
+    }
+}
+
+/* Run the command of every client whose line is complete; drop those too slow to send one. */
+static void control_poll(fd_set *fds) {
+    if (control_fd >= 0 && FD_ISSET(control_fd, fds))
+        control_accept();
+    double now = monotonic_now();
+    for (int i = 0; i < ncontrol_clients; ) {
+        struct ControlClient *c = &control_clients[i];
+        ssize_t n = 0;
+        // Just-accepted clients have usually sent their line already, so try every one.
+        while (c->len < sizeof(c->line) - 1 &&
+               (n = recv(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len, 0)) > 0)
+            c->len += n;
+        int ended = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+        if (memchr(c->line, '\n', c->len) || c->len == sizeof(c->line) - 1 || (ended && c->len > 0)) {
+            c->line[c->len] = '\0';
+            c->line[strcspn(c->line, "\r\n")] = '\0';
+            control_command(c->fd, c->line);
+        } else if (!ended && now < c->deadline) {
+            i++;
+            continue;
+        } else if (!ended) {
+            LOG_WARNING("ctl", "Dropped a client that sent no command");
+        }
+        close(c->fd);
+        *c = control_clients[--ncontrol_clients];
+    }
+}
+
+/* Client side: send one command to the running instance and print its reply. */
+static int control_client(int argc, char *argv[]) {
+    char line[512];
+    size_t len = 0;
+    if (strcmp(argv[1], "--show") == 0) {
+        len = snprintf(line, sizeof(line), "show");
+        for (int i = 2; i < argc && len < sizeof(line); i++) {
+            if (strcmp(argv[i], "--menu") == 0 && i + 1 < argc)
+                len += snprintf(line + len, sizeof(line) - len, " menu %s", argv[++i]);
+            else
+                len += snprintf(line + len, sizeof(line) - len, " %s", argv[i]);
+        }
+    } else if (argc == 2 && strcmp(argv[1], "--reload") == 0) {
+        len = snprintf(line, sizeof(line), "reload");
+    } else if (argc == 2 && strcmp(argv[1], "--stats") == 0) {
+        len = snprintf(line, sizeof(line), "stats");
+    } else if (argc == 3 && strcmp(argv[1], "--stats") == 0 && strcmp(argv[2], "--json") == 0) {
+        len = snprintf(line, sizeof(line), "stats json");
+    } else {
+        fprintf(stderr, "usage: gmenu [--show [x y] [--menu name] | --reload | --stats [--json]]\n");
+        return 1;
+    }
+    if (len >= sizeof(line) - 1) {
+        fprintf(stderr, "gmenu: command too long\n");
+        return 1;
+    }
+    line[len++] = '\n';
+
+    struct sockaddr_un addr;
+    if (control_socket_path(&addr) < 0) {
+        fprintf(stderr, "gmenu: no private directory for the control socket\n");
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "gmenu: no running instance at %s\n", addr.sun_path);
+        return 1;
+    }
+    if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        fprintf(stderr, "gmenu: cannot send to %s\n", addr.sun_path);
+        return 1;
+    }
+    char reply[4096];
+    ssize_t n;
+    int status = 0, first = 1;
+    while ((n = recv(fd, reply, sizeof(reply), 0)) > 0) {
+        if (first && n >= 6 && strncmp(reply, "error:", 6) == 0)
+            status = 1;
+        first = 0;
+        // "ok" is implied by the exit status.
+        if (!(n == 3 && strncmp(reply, "ok\n", 3) == 0))
+            fwrite(reply, 1, n, status ? stderr : stdout);
+    }
+    close(fd);
+    return status;
+}
+
+/*
+ * Latency histograms, HDR style: exact below 16, then 16 linear buckets
+ * per power of two, so any value is kept to within about 6%. Values are
+ * microseconds, or a plain count for the request histogram.
+ */
+static int hist_index(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/* Largest value that falls into bucket i. */
+static uint64_t hist_bucket_max(int i) {
+    if (i < (1 << HIST_SUB_BITS))
+        return i;
+    int e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = i & ((1u << HIST_SUB_BITS) - 1);
+    return (((1u << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_add(struct Histogram *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+    h->last = v;
+}
+
+/* Record the time since start, in microseconds. */
+static void hist_time(struct Histogram *h, double start) {
+    double us = (monotonic_now() - start) * 1e6;
+    hist_add(h, us > 0 ? (uint64_t)us : 0);
+}
+
+static uint64_t hist_percentile(const struct Histogram *h, double p) {
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100 * h->count), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_bucket_max(i) < h->max ? hist_bucket_max(i) : h->max;
+    }
+    return h->max;
+}
+
+/* Stats are written as "name value" lines or as one JSON object. */
+struct StatsOut {
+    char *buf;
+    size_t size, len;
+    int json;
+};
+
+static void stats_printf(struct StatsOut *o, const char *fmt, ...) {
+    if (o->len >= o->size)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, args);
+    va_end(args);
+    o->len = n < 0 ? o->len : o->len + n < o->size ? o->len + n : o->size - 1;
+}
+
+static void stat_num(struct StatsOut *o, const char *name, double v) {
+    stats_printf(o, o->json ? "%s\"%s\": %.10g" : "%s%s %.10g\n", o->json && o->len > 1 ? ", " : "", name, v);
+}
+
+static void stat_str(struct StatsOut *o, const char *name, const char *v) {
+    stats_printf(o, o->json ? "%s\"%s\": \"%s\"" : "%s%s %s\n", o->json && o->len > 1 ? ", " : "", name, v);
+}
+
+static void stat_hist(struct StatsOut *o, const struct Histogram *h) {
+    const double pcts[] = { 50, 90, 99, 99.9 };
+    const char *pct_names[] = { "p50", "p90", "p99", "p999" };
+    stats_printf(o, o->json ? "%s\"%s\": {\"count\": %llu, \"min\": %llu" : "%s%s count %llu min %llu",
+                 o->json ? ", " : "", h->name, (unsigned long long)h->count, (unsigned long long)h->min);
+    for (int i = 0; i < 4; i++)
+        stats_printf(o, o->json ? ", \"%s\": %llu" : " %s %llu", pct_names[i],
+                     (unsigned long long)hist_percentile(h, pcts[i]));
+    stats_printf(o, o->json ? ", \"max\": %llu, \"mean\": %.1f, \"last\": %llu}" : " max %llu mean %.1f last %llu\n",
+                 (unsigned long long)h->max, h->count ? (double)h->sum / h->count : 0.0,
+                 (unsigned long long)h->last);
+}
+
+/* Format the counters and histograms into buf; returns the length. */
+static size_t format_stats(char *buf, size_t size, int json) {
+    struct StatsOut o = { buf, size, 0, json };
+    int nsubitems = 0;
+    for (int d = 0; d < model.nsub; d++)
+        nsubitems += model.sub[d].n;
+    if (json)
+        stats_printf(&o, "{");
+    stat_num(&o, "uptime_s", floor(monotonic_now() - start_time));
+    stat_num(&o, "items", model.nitems);
+    stat_num(&o, "subitems", nsubitems);
+    stat_num(&o, "label_bytes", model.strings_len);
+    stat_num(&o, "shows", nshows);
+    stat_num(&o, "reloads", nreloads);
+    stat_num(&o, "launches", nlaunches);
+    stat_num(&o, "pipe_runs", pipe_runs);
+    stat_num(&o, "pipe_timeouts", pipe_timeouts);
+    stat_num(&o, "icons", icons_found);
+    stat_num(&o, "icons_missing", icons_missing);
+    stat_num(&o, "parse_errors", parse_errors);
+    stat_num(&o, "spare_windows", nspare_popups);
+    stat_num(&o, "item_height", itemheight);
+    stat_num(&o, "menu_load_ms", last_load_ms);
+    stat_str(&o, "menu_source", last_load_cached ? "cache" : "parsed");
+    stat_num(&o, "x_requests", dpy ? NextRequest(dpy) - 1 : 0);
+    stat_num(&o, "x_round_trips", x_round_trips);
+    stat_num(&o, "motion_coalesced", motion_coalesced);
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++)
+        stat_hist(&o, histograms[i]);
+    if (json)
+        stats_printf(&o, "}\n");
+    return o.len;
+}
+
+/* SIGUSR1: text on stderr, JSON in the runtime directory beside the control socket. */
+static void dump_stats(void) {
+    static char buf[8192];
+    size_t len = format_stats(buf, sizeof(buf), 0);
+    write_all(STDERR_FILENO, buf, len);
+
+    struct sockaddr_un addr;
+    if (control_socket_path(&addr) < 0)
+        return;
+    char path[sizeof(addr.sun_path) + 16];
+    snprintf(path, sizeof(path), "%.*s-stats.json", (int)strlen(addr.sun_path) - 5, addr.sun_path);
+    len = format_stats(buf, sizeof(buf), 1);
+    if (write_atomically(path, buf, len) != 0)
+        LOG_WARNING("stats", "Could not write %s", path);
+    else
+        LOG("stats", "Wrote %s", path);
+}
+
+/*
+ * Re-read the config and/or item file and rebuild only what changed: the
+ * font is reopened only if its name changed, colors are re-resolved only if
+ * they changed, and windows are resized and repainted rather than recreated.
+ */
+static void reload(int what) {
+    struct Config old = config;
+    nreloads++;
+    char *old_font = strdup(config.font);
+    int reload_items = what & RELOAD_ITEMS;
+
+    if (what & RELOAD_CONFIG) {
+        if (config.font && strcmp(config.font, "fixed") != 0)
+            free(config.font);
+        config = default_config;
+        load_config(config_path);
+        if (strcmp(old.log_file, config.log_file) != 0)
+            log_open(config.log_file);
+    }
+
+    int font_changed = (old_font && strcmp(old_font, config.font) != 0) ||
+                       strcmp(old.font_fallback, config.font_fallback) != 0;
+    int colors_changed = old.fg != config.fg || old.bg != config.bg ||
+                         old.selfg != config.selfg || old.selbg != config.selbg ||
+                         old.border_color != config.border_color ||
+                         old.alpha != config.alpha || old.selalpha != config.selalpha;
+    int geometry_changed = old.border_width != config.border_width ||
+                           old.icon_left_padding != config.icon_left_padding ||
+                           old.icon_right_padding != config.icon_right_padding ||
+                           old.corner_radius != config.corner_radius || old.shadow != config.shadow;
+    int renderer_changed = old.renderer != config.renderer;
+    free(old_font);
+
+    if (colors_changed) {
+        XftColorFree(dpy, menu_vi.visual, menu_cmap, &palette.fg);
+        XftColorFree(dpy, menu_vi.visual, menu_cmap, &palette.selfg);
+        setup_palette();
+        // Plain segments carry the foreground color resolved at parse time.
+        if (old.fg != config.fg)
+            reload_items = 1;
+    }
+    if (old.applications != config.applications)
+        reload_items = 1;
+    if (font_changed) {
+        free_fonts();
+        load_font();
+        reload_items = 1;  // Labels are split into font runs while parsing.
+    }
+    int theme_changed = strcmp(old.icon_theme, config.icon_theme) != 0;
+    if (!reload_items && !font_changed && !colors_changed && !geometry_changed &&
+        !theme_changed && !renderer_changed && old.recent_items == config.recent_items) {
+        LOG("reload", "Nothing changed");
+        return;
+    }
+
+    release_submenu_windows();
+    if (reload_items) {
+        free_model();
+        read_input(items_path);
+        if (nlevels > 0) {
+            struct MenuLevel top = { model.items, model.nitems, &main_surf, -1, levels[0].x, levels[0].y };
+            levels[0] = top;
+        }
+    }
+    if (reload_items || font_changed || geometry_changed)
+        layout_items();
+    if (reload_items || old.recent_items != config.recent_items)
+        update_recent_menu();
+
+    if (old.border_width != config.border_width)
+        XSetWindowBorderWidth(dpy, win, config.border_width);
+    if (old.border_color != config.border_color)
+        XSetWindowBorder(dpy, win, config.border_color);
+    menuheight = capped_rows(model.nitems) * itemheight + 2 * config.border_width + 4;
+    surface_resize(&main_surf, max_menuwidth, menuheight);
+    if (theme_changed)
+        icons_load();
+    LOG("reload", "Reloaded:%s%s%s%s%s%s", reload_items ? " items" : "", font_changed ? " font" : "",
+        colors_changed ? " colors" : "", geometry_changed ? " geometry" : "",
+        theme_changed ? " icon theme" : "", renderer_changed ? " renderer" : "");
+}
+
 static void load_font(void) {
     xft_font = XftFontOpenName(dpy, screen, config.font);
     if (!xft_font) {
@@ -171,238 +1439,2672 @@ static void load_font(void) {
         }
     }
     itemheight = xft_font->ascent + xft_font->descent + 4 + VERTICAL_PADDING;
+    icon_size = xft_font->ascent + xft_font->descent;
+    font_add(xft_font, NULL, xft_font->charset);
+
+    char list[sizeof(config.font_fallback)];
+    snprintf(list, sizeof(list), "%s", config.font_fallback);
+    char *save;
+    for (char *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        while (isspace((unsigned char)*name))
+            name++;
+        if (!*name)
+            continue;
+        XftFont *f = XftFontOpenName(dpy, screen, name);
+        if (f)
+            font_add(f, NULL, f->charset);
+        else
+            LOG_WARNING("font", "Fallback font not found: %s", name);
+    }
 }
 
-static void setup(void) {
-    XSetWindowAttributes wa;
-    menuheight = nitems * itemheight + 2 * config.border_width + 4;
+/* Pick the ARGB visual and its Render format; needed before any color is resolved. */
+static void setup_visual(void) {
     if (!XMatchVisualInfo(dpy, screen, 32, TrueColor, &menu_vi)) {
         fprintf(stderr, "gmenu: No 32-bit TrueColor visual available\n");
         exit(1);
     }
     menu_cmap = XCreateColormap(dpy, root, menu_vi.visual, AllocNone);
+    menu_fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
+    if (!menu_fmt) {
+        fprintf(stderr, "gmenu: No matching XRenderPictFormat for visual\n");
+        exit(1);
+    }
+}
+
+/* Convert 0xRRGGBB plus opacity to a premultiplied 16-bit Render color. */
+static XRenderColor render_color(unsigned long rgb, double alpha) {
+    unsigned short a = alpha * 0xFFFF;
+    XRenderColor c = {
+        .red   = ((rgb >> 16) & 0xFF) * 0x101 * a / 0xFFFF,
+        .green = ((rgb >> 8)  & 0xFF) * 0x101 * a / 0xFFFF,
+        .blue  = (rgb & 0xFF) * 0x101 * a / 0xFFFF,
+        .alpha = a
+    };
+    return c;
+}
+
+static void setup_palette(void) {
+    palette.bg = render_color(config.bg, config.alpha);
+    palette.selbg = render_color(config.selbg, config.selalpha);
+    palette.separator = render_color(config.border_color, config.alpha);
+    XRenderColor c = render_color(config.fg, 1.0);
+    XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &c, &palette.fg);
+    c = render_color(config.selfg, 1.0);
+    XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &c, &palette.selfg);
+}
+
+static void setup(void) {
+    XSetWindowAttributes wa;
+    menuheight = capped_rows(model.nitems) * itemheight + 2 * config.border_width + 4;
     wa.colormap = menu_cmap;
     wa.background_pixmap = None;
     wa.background_pixel = config.bg;
     wa.border_pixel = config.border_color;
-    wa.event_mask = ExposureMask | ButtonPressMask | PointerMotionMask | LeaveWindowMask;
+    wa.event_mask = ExposureMask | ButtonPressMask | PointerMotionMask | LeaveWindowMask | KeyPressMask |
+                    StructureNotifyMask;
     wa.override_redirect = True;
     win = XCreateWindow(dpy, root, 0, 0, max_menuwidth, menuheight,
                         config.border_width, menu_vi.depth, InputOutput, menu_vi.visual,
                         CWColormap | CWBorderPixel | CWBackPixel | CWEventMask | CWOverrideRedirect, &wa);
-    main_draw = XftDrawCreate(dpy, win, menu_vi.visual, menu_cmap);
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-    if (!fmt) {
-        fprintf(stderr, "gmenu: No matching XRenderPictFormat for visual\n");
+    surface_init(&main_surf, win, max_menuwidth, menuheight);
+    gc = XCreateGC(dpy, win, 0, NULL);
+}
+
+static void surface_alloc_buffer(struct Surface *s) {
+    s->buffer = XCreatePixmap(dpy, s->win, s->width, s->height, menu_vi.depth);
+    s->pict = XRenderCreatePicture(dpy, s->buffer, menu_fmt, 0, NULL);
+    if (!s->pict) {
+        LOG_ERR("x", "Failed to create back buffer picture");
+        fprintf(stderr, "gmenu: Failed to create back buffer picture\n");
         exit(1);
     }
-    Picture pict = XRenderCreatePicture(dpy, win, fmt, 0, NULL);
-    if (!pict) {
-        fprintf(stderr, "gmenu: Failed to create picture for main window\n");
+    s->draw = XftDrawCreate(dpy, s->buffer, menu_vi.visual, menu_cmap);
+    XRenderFillRectangle(dpy, PictOpSrc, s->pict, &palette.bg, 0, 0, s->width, s->height);
+    if (config.renderer == RENDER_SOFTWARE)
+        raster_alloc(s);
+    s->dmg_x0 = s->dmg_y0 = 0;
+    s->dmg_x1 = s->dmg_y1 = 0;
+}
+
+static void surface_free_buffer(struct Surface *s) {
+    raster_free(s);
+    if (s->draw)
+        XftDrawDestroy(s->draw);
+    if (s->pict)
+        XRenderFreePicture(dpy, s->pict);
+    if (s->buffer)
+        XFreePixmap(dpy, s->buffer);
+    s->draw = NULL;
+    s->pict = None;
+    s->buffer = None;
+}
+
+static void surface_init(struct Surface *s, Window w, int width, int height) {
+    s->win = w;
+    s->width = width;
+    s->height = height;
+    s->win_pict = XRenderCreatePicture(dpy, w, menu_fmt, 0, NULL);
+    if (!s->win_pict) {
+        LOG_ERR("x", "Failed to create picture for menu window");
+        fprintf(stderr, "gmenu: Failed to create picture for menu window\n");
         exit(1);
     }
-    XRenderColor bg = {
-        .red = ((config.bg >> 16) & 0xFF) * 0xFFFF / 0xFF,
-        .green = ((config.bg >> 8) & 0xFF) * 0xFFFF / 0xFF,
-        .blue = (config.bg & 0xFF) * 0xFFFF / 0xFF,
-        .alpha = config.alpha * 0xFFFF
-    };
-    XRenderFillRectangle(dpy, PictOpSrc, pict, &bg, 0, 0, max_menuwidth, menuheight);
-    XRenderFreePicture(dpy, pict);
-    gc = XCreateGC(dpy, win, 0, NULL);
-    XRenderColor render_color;
-    render_color.red = ((config.fg >> 16) & 0xFF) * 0xFFFF / 0xFF;
-    render_color.green = ((config.fg >> 8) & 0xFF) * 0xFFFF / 0xFF;
-    render_color.blue = (config.fg & 0xFF) * 0xFFFF / 0xFF;
-    render_color.alpha = 0xFFFF;
-    XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &render_color, &xft_fg);
-    render_color.red = ((config.selfg >> 16) & 0xFF) * 0xFFFF / 0xFF;
-    render_color.green = ((config.selfg >> 8) & 0xFF) * 0xFFFF / 0xFF;
-    render_color.blue = (config.selfg & 0xFF) * 0xFFFF / 0xFF;
-    render_color.alpha = 0xFFFF;
-    XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &render_color, &xft_selfg);
+    surface_alloc_buffer(s);
 }
 
-static void read_input(const char *path) {
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-        // Fallback if no .gmenu_items
-        nitems = 3;
-        strncpy(items[0].label, "File Manager", MAX_LABEL - 1);
-        strncpy(items[0].output, "thunar", MAX_LABEL - 1);
-        items[0].submenu = NULL;
-        items[0].nsubitems = 0;
+/* Resize the window and its back buffer in place; the buffer is cleared. */
+static void surface_resize(struct Surface *s, int width, int height) {
+    if (s->width == width && s->height == height &&
+        (s->pixels != NULL) == (config.renderer == RENDER_SOFTWARE))
+        return;
+    XResizeWindow(dpy, s->win, width, height);
+    s->width = width;
+    s->height = height;
+    surface_free_buffer(s);
+    surface_alloc_buffer(s);
+}
 
-        strncpy(items[1].label, "Reboot", MAX_LABEL - 1);
-        strncpy(items[1].output, "reboot", MAX_LABEL - 1);
-        items[1].submenu = NULL;
-        items[1].nsubitems = 0;
+static void surface_free(struct Surface *s) {
+    surface_free_buffer(s);
+    if (s->win_pict)
+        XRenderFreePicture(dpy, s->win_pict);
+    memset(s, 0, sizeof(*s));
+}
 
-        strncpy(items[2].label, "Shutdown", MAX_LABEL - 1);
-        strncpy(items[2].output, "poweroff", MAX_LABEL - 1);
-        items[2].submenu = NULL;
-        items[2].nsubitems = 0;
+/* Grow the pending damage box; present() copies it to the window. */
+static void damage(struct Surface *s, int x, int y, int width, int height) {
+    if (s->dmg_x1 <= s->dmg_x0 || s->dmg_y1 <= s->dmg_y0) {
+        s->dmg_x0 = x;
+        s->dmg_y0 = y;
+        s->dmg_x1 = x + width;
+        s->dmg_y1 = y + height;
         return;
     }
+    if (x < s->dmg_x0) s->dmg_x0 = x;
+    if (y < s->dmg_y0) s->dmg_y0 = y;
+    if (x + width > s->dmg_x1) s->dmg_x1 = x + width;
+    if (y + height > s->dmg_y1) s->dmg_y1 = y + height;
+}
 
-    char line[512];
-    struct Item *current_parent = NULL;
-    nitems = 0;
+/* Show the finished frame with a single composite of the damaged area. */
+static void present(struct Surface *s) {
+    if (!s->win || s->dmg_x1 <= s->dmg_x0 || s->dmg_y1 <= s->dmg_y0)
+        return;
+    XRenderComposite(dpy, PictOpSrc, s->pict, None, s->win_pict,
+                     s->dmg_x0, s->dmg_y0, 0, 0, s->dmg_x0, s->dmg_y0,
+                     s->dmg_x1 - s->dmg_x0, s->dmg_y1 - s->dmg_y0);
+    s->dmg_x0 = s->dmg_y0 = s->dmg_x1 = s->dmg_y1 = 0;
+}
 
-    while (fgets(line, sizeof(line), fp) && nitems < MAX_ITEMS) {
-        line[strcspn(line, "\n")] = 0;  // strip newline
-        if (!line[0])
-            continue;
+/*
+ * Software renderer (renderer = software). Fills, the rounded selection and
+ * its shadow, and the rounded window corners are rasterized into a client
+ * copy of the back buffer with SSE2 (or AVX2) span blending. A frame is
+ * uploaded with one XShmPutImage, or XPutImage where MIT-SHM is unavailable
+ * (e.g. a remote display). Text and icons are still drawn by the server on
+ * top of the upload. The server reads a segment only when it gets to the
+ * XShmPutImage, so the pixels are not touched again until it has (raster_wait).
+ */
+static int shm_state = -1;  // -1 unknown, 0 unavailable, 1 supported, 2 attach known to work.
+static int shm_failed = 0;
+
+static int shm_error_handler(Display *d, XErrorEvent *e) {
+    (void)d;
+    (void)e;
+    shm_failed = 1;
+    return 0;
+}
+
+/* Premultiplied 16-bit Render color to a 32-bit ARGB pixel. */
+static uint32_t pack_color(const XRenderColor *c) {
+    return (uint32_t)(c->alpha >> 8) << 24 | (uint32_t)(c->red >> 8) << 16 |
+           (uint32_t)(c->green >> 8) << 8 | (uint32_t)(c->blue >> 8);
+}
+
+/* Each channel of p times a / 255, rounded. */
+static uint32_t scale_pixel(uint32_t p, uint32_t a) {
+    uint32_t rb = (p & 0xFF00FF) * a + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xFF00FF)) >> 8) & 0xFF00FF;
+    uint32_t ag = ((p >> 8) & 0xFF00FF) * a + 0x800080;
+    ag = (ag + ((ag >> 8) & 0xFF00FF)) & 0xFF00FF00;
+    return rb | ag;
+}
+
+static void fill_span(uint32_t *dst, int n, uint32_t color) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i c = _mm_set1_epi32(color);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), c);
+#endif
+    for (; i < n; i++)
+        dst[i] = color;
+}
+
+#ifdef __SSE2__
+/* Four pixels times ia / 255, rounded, as in scale_pixel. */
+static inline __m128i scale_4(__m128i d, __m128i ia) {
+    __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia), bias);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia), bias);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+/* Composite a premultiplied color over n pixels. */
+static void blend_span(uint32_t *dst, int n, uint32_t color) {
+    uint32_t ia = 255 - (color >> 24);
+    if (ia == 0) {
+        fill_span(dst, n, color);
+        return;
+    }
+    int i = 0;
+#ifdef __AVX2__
+    __m256i zero8 = _mm256_setzero_si256(), bias8 = _mm256_set1_epi16(128);
+    __m256i ia8 = _mm256_set1_epi16(ia), src8 = _mm256_set1_epi32(color);
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero8), ia8), bias8);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero8), ia8), bias8);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), src8));
+    }
+#endif
+#ifdef __SSE2__
+    __m128i ia4 = _mm_set1_epi16(ia), src4 = _mm_set1_epi32(color);
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(scale_4(d, ia4), src4));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = color + scale_pixel(dst[i], ia);
+}
+
+static void raster_damage(struct Surface *s, int x, int y, int width, int height) {
+    if (s->rst_x1 <= s->rst_x0 || s->rst_y1 <= s->rst_y0) {
+        s->rst_x0 = x;
+        s->rst_y0 = y;
+        s->rst_x1 = x + width;
+        s->rst_y1 = y + height;
+        return;
+    }
+    if (x < s->rst_x0) s->rst_x0 = x;
+    if (y < s->rst_y0) s->rst_y0 = y;
+    if (x + width > s->rst_x1) s->rst_x1 = x + width;
+    if (y + height > s->rst_y1) s->rst_y1 = y + height;
+}
+
+/* Clip a rectangle to the surface; returns 0 if nothing is left. */
+static int clip_rect(struct Surface *s, int *x, int *y, int *width, int *height) {
+    if (*x < 0) { *width += *x; *x = 0; }
+    if (*y < 0) { *height += *y; *y = 0; }
+    if (*x + *width > s->width) *width = s->width - *x;
+    if (*y + *height > s->height) *height = s->height - *y;
+    return *width > 0 && *height > 0;
+}
+
+static Bool is_later_event(Display *d, XEvent *ev, XPointer serial) {
+    (void)d;
+    return (long)(ev->xany.serial - *(unsigned long *)serial) >= 0;
+}
+
+/*
+ * Wait until the server has copied the last shared-memory upload out of the
+ * pixels. Any reply or event from a later request proves it; the
+ * ShmCompletion asked for in raster_flush arrives at the latest.
+ */
+static void raster_wait(struct Surface *s) {
+    if (!s->shm_serial)
+        return;
+    if ((long)(LastKnownRequestProcessed(dpy) - s->shm_serial) < 0) {
+        XEvent ev;
+        ROUND_TRIP(XPeekIfEvent(dpy, &ev, is_later_event, (XPointer)&s->shm_serial));
+    }
+    s->shm_serial = 0;
+}
+
+/* Fill a rectangle of the back buffer, replacing what is there. */
+static void paint_fill(struct Surface *s, const XRenderColor *c, int x, int y, int width, int height) {
+    if (!s->pixels) {
+        XRenderFillRectangle(dpy, PictOpSrc, s->pict, c, x, y, width, height);
+        return;
+    }
+    if (!clip_rect(s, &x, &y, &width, &height))
+        return;
+    raster_wait(s);
+    uint32_t color = pack_color(c);
+    for (int row = y; row < y + height; row++)
+        fill_span(s->pixels + (size_t)row * s->stride + x, width, color);
+    raster_damage(s, x, y, width, height);
+}
+
+/* Coverage (0-255) of pixel (px, py) by a rounded rectangle whose edge fades over feather pixels. */
+static uint32_t round_rect_coverage(double cx, double cy, double hx, double hy, double r,
+                                    double feather, int px, int py) {
+    double qx = fabs(px + 0.5 - cx) - hx, qy = fabs(py + 0.5 - cy) - hy;
+    double dist;
+    if (qx <= 0 && qy <= 0)
+        dist = qx > qy ? qx : qy;
+    else
+        dist = sqrt((qx > 0 ? qx * qx : 0) + (qy > 0 ? qy * qy : 0));
+    double cov = (r - dist) / feather + 0.5;
+    return cov <= 0 ? 0 : cov >= 1 ? 255 : (uint32_t)(cov * 255 + 0.5);
+}
+
+/*
+ * Composite color over a rounded rectangle, anti-aliased; a feather above
+ * 1 softens the edge, which is how shadows are drawn. Fully covered runs go
+ * through blend_span, only the edge pixels are blended one at a time.
+ */
+static void raster_round_rect(struct Surface *s, int x, int y, int width, int height, int r,
+                              double feather, uint32_t color) {
+    if (width <= 0 || height <= 0)
+        return;
+    if (r > width / 2) r = width / 2;
+    if (r > height / 2) r = height / 2;
+    double cx = x + width / 2.0, cy = y + height / 2.0;
+    double hx = width / 2.0 - r, hy = height / 2.0 - r;
+    int grow_by = (int)ceil(feather / 2);
+    int x0 = x - grow_by, y0 = y - grow_by, w = width + 2 * grow_by, h = height + 2 * grow_by;
+    if (!clip_rect(s, &x0, &y0, &w, &h))
+        return;
+    raster_wait(s);
+    for (int py = y0; py < y0 + h; py++) {
+        uint32_t *row = s->pixels + (size_t)py * s->stride;
+        int run = -1;
+        for (int px = x0; px <= x0 + w; px++) {
+            uint32_t cov = px < x0 + w ? round_rect_coverage(cx, cy, hx, hy, r, feather, px, py) : 0;
+            if (cov == 255) {
+                if (run < 0)
+                    run = px;
+                continue;
+            }
+            if (run >= 0) {
+                blend_span(row + run, px - run, color);
+                run = -1;
+            }
+            if (cov > 0) {
+                uint32_t c = scale_pixel(color, cov);
+                row[px] = c + scale_pixel(row[px], 255 - (c >> 24));
+            }
+        }
+    }
+    raster_damage(s, x0, y0, w, h);
+}
+
+/* Make the window's corners transparent outside a radius, within the given box. */
+static void raster_clip_corners(struct Surface *s, int x0, int y0, int x1, int y1) {
+    int r = config.corner_radius;
+    if (r > s->width / 2) r = s->width / 2;
+    if (r > s->height / 2) r = s->height / 2;
+    if (r <= 0)
+        return;
+    double cx = s->width / 2.0, cy = s->height / 2.0, hx = cx - r, hy = cy - r;
+    int corners[4][2] = { { 0, 0 }, { s->width - r, 0 }, { 0, s->height - r }, { s->width - r, s->height - r } };
+    for (int k = 0; k < 4; k++) {
+        int bx0 = corners[k][0] > x0 ? corners[k][0] : x0, bx1 = corners[k][0] + r < x1 ? corners[k][0] + r : x1;
+        int by0 = corners[k][1] > y0 ? corners[k][1] : y0, by1 = corners[k][1] + r < y1 ? corners[k][1] + r : y1;
+        for (int py = by0; py < by1; py++)
+            for (int px = bx0; px < bx1; px++) {
+                uint32_t cov = round_rect_coverage(cx, cy, hx, hy, r, 1, px, py);
+                if (cov < 255) {
+                    uint32_t *p = s->pixels + (size_t)py * s->stride + px;
+                    *p = scale_pixel(*p, cov);
+                }
+            }
+    }
+}
+
+/* Give the surface a client-side pixel buffer, shared with the server if possible. */
+static void raster_alloc(struct Surface *s) {
+    s->shm.shmid = -1;
+    s->shm_serial = 0;
+    s->rst_x0 = s->rst_y0 = s->rst_x1 = s->rst_y1 = 0;
+    if (shm_state < 0)
+        shm_state = XShmQueryExtension(dpy) ? 1 : 0;
+    if (shm_state > 0) {
+        s->image = XShmCreateImage(dpy, menu_vi.visual, 32, ZPixmap, NULL, &s->shm, s->width, s->height);
+        if (s->image)
+            s->shm.shmid = shmget(IPC_PRIVATE, (size_t)s->image->bytes_per_line * s->height, IPC_CREAT | 0600);
+        if (s->shm.shmid >= 0) {
+            s->shm.shmaddr = s->image->data = shmat(s->shm.shmid, NULL, 0);
+            s->shm.readOnly = True;
+            shm_failed = s->shm.shmaddr == (char *)-1;
+            if (!shm_failed) {
+                // A remote server cannot attach; find out once, synchronously.
+                XErrorHandler old = shm_state == 1 ? XSetErrorHandler(shm_error_handler) : NULL;
+                XShmAttach(dpy, &s->shm);
+                if (shm_state == 1) {
+                    ROUND_TRIP(XSync(dpy, False));
+                    XSetErrorHandler(old);
+                }
+            }
+            shmctl(s->shm.shmid, IPC_RMID, NULL);  // Freed once both sides detach.
+            if (shm_failed) {
+                if (s->shm.shmaddr != (char *)-1)
+                    shmdt(s->shm.shmaddr);
+                s->shm.shmid = -1;
+            }
+        }
+        if (s->shm.shmid >= 0) {
+            shm_state = 2;
+        } else {
+            if (s->image) {
+                s->image->data = NULL;
+                XDestroyImage(s->image);
+                s->image = NULL;
+            }
+            LOG_WARNING("render", "MIT-SHM unavailable, uploading frames with XPutImage");
+            shm_state = 0;
+        }
+    }
+    if (!s->image) {
+        char *data = calloc((size_t)s->width * s->height, sizeof(uint32_t));
+        if (!data) {
+            fprintf(stderr, "gmenu: Memory allocation failed for the frame buffer\n");
+            exit(1);
+        }
+        s->image = XCreateImage(dpy, menu_vi.visual, 32, ZPixmap, 0, data, s->width, s->height, 32, 0);
+        uint32_t one = 1;
+        s->image->byte_order = *(char *)&one ? LSBFirst : MSBFirst;  // Xlib swaps for the server if needed.
+    }
+    s->pixels = (uint32_t *)s->image->data;
+    s->stride = s->image->bytes_per_line / sizeof(uint32_t);
+    paint_fill(s, &palette.bg, 0, 0, s->width, s->height);
+    s->rst_x0 = s->rst_y0 = s->rst_x1 = s->rst_y1 = 0;  // The server buffer was filled alike.
+}
+
+static void raster_free(struct Surface *s) {
+    if (!s->image)
+        return;
+    if (s->shm.shmid >= 0) {
+        XShmDetach(dpy, &s->shm);
+        shmdt(s->shm.shmaddr);
+        s->image->data = NULL;
+    }
+    XDestroyImage(s->image);  // Frees the pixels too when they are ordinary memory.
+    s->image = NULL;
+    s->pixels = NULL;
+    s->shm.shmid = -1;
+}
+
+/* Upload what was rasterized since the last flush into the back buffer. */
+static void raster_flush(struct Surface *s) {
+    if (!s->pixels || s->rst_x1 <= s->rst_x0 || s->rst_y1 <= s->rst_y0)
+        return;
+    int x = s->rst_x0, y = s->rst_y0, width = s->rst_x1 - x, height = s->rst_y1 - y;
+    raster_wait(s);
+    raster_clip_corners(s, s->rst_x0, s->rst_y0, s->rst_x1, s->rst_y1);
+    if (s->shm.shmid >= 0) {
+        s->shm_serial = NextRequest(dpy);
+        XShmPutImage(dpy, s->buffer, gc, s->image, x, y, x, y, width, height, True);
+    } else
+        XPutImage(dpy, s->buffer, gc, s->image, x, y, x, y, width, height);
+    s->rst_x0 = s->rst_y0 = s->rst_x1 = s->rst_y1 = 0;
+}
+
+/* Grow a realloc-backed array so it can hold n elements. */
+static void *grow(void *v, int *cap, int n, size_t size) {
+    if (n <= *cap)
+        return v;
+    int newcap = *cap ? *cap * 2 : 16;
+    while (newcap < n)
+        newcap *= 2;
+    void *nv = realloc(v, (size_t)newcap * size);
+    if (!nv) {
+        fprintf(stderr, "gmenu: Memory allocation failed for menu items\n");
+        exit(1);
+    }
+    *cap = newcap;
+    return nv;
+}
+
+/* Copy len bytes into the string arena, NUL-terminated, and return the offset. */
+static unsigned int intern(const char *s, size_t len) {
+    if (arena->strings_len + len + 1 > arena->strings_cap) {
+        size_t newcap = arena->strings_cap ? arena->strings_cap * 2 : 4096;
+        while (newcap < arena->strings_len + len + 1)
+            newcap *= 2;
+        char *ns = realloc(arena->strings, newcap);
+        if (!ns) {
+            fprintf(stderr, "gmenu: Memory allocation failed for labels\n");
+            exit(1);
+        }
+        arena->strings = ns;
+        arena->strings_cap = newcap;
+    }
+    unsigned int off = arena->strings_len;
+    memcpy(arena->strings + off, s, len);
+    arena->strings[off + len] = '\0';
+    arena->strings_len += len + 1;
+    return off;
+}
+
+/*
+ * Font fallback. A glyph config.font lacks is drawn with the first font in
+ * the chain that has it: config.font, each font_fallback entry, then the
+ * fonts fontconfig sorts after config.font, appended on the first miss and
+ * opened on first use. add_segment splits labels into one-font runs while
+ * parsing and coverage[] memoizes the font per codepoint, so painting never
+ * asks fontconfig anything.
+ */
+#define MAX_FONTS 255  // Font indices are stored in an unsigned char.
+
+struct FontSlot {
+    XftFont *font;       // NULL until a sorted candidate is first used.
+    FcPattern *pattern;  // Sorted candidate, ready for XftFontOpenPattern; NULL for configured fonts.
+    FcCharSet *charset;  // Owned by font or pattern.
+};
+
+static struct FontSlot *fonts = NULL;
+static int nfonts = 0, fonts_cap = 0;
+static int fonts_sorted = 0;                    // fontconfig's candidates were appended.
+static uint64_t fonts_sorted_key = 0;           // Hash of their families and files, once sorted.
+static unsigned char *coverage[0x110000 >> 8];  // Pages of 256 codepoints: font index + 1, 0 if unknown.
+
+static void font_add(XftFont *font, FcPattern *pattern, FcCharSet *charset) {
+    if (nfonts == MAX_FONTS) {
+        if (pattern)
+            FcPatternDestroy(pattern);
+        if (font)
+            XftFontClose(dpy, font);
+        return;
+    }
+    fonts = grow(fonts, &fonts_cap, nfonts + 1, sizeof(struct FontSlot));
+    fonts[nfonts++] = (struct FontSlot){ font, pattern, charset };
+}
+
+static void sort_fonts(void) {
+    fonts_sorted = 1;
+    fonts_sorted_key = fnv1a(0xcbf29ce484222325ULL, "fonts", 5);
+    FcPattern *pat = FcNameParse((const FcChar8 *)config.font);
+    if (!pat)
+        return;
+    FcConfigSubstitute(NULL, pat, FcMatchPattern);
+    FcDefaultSubstitute(pat);
+    FcResult result;
+    FcFontSet *set = FcFontSort(NULL, pat, FcTrue, NULL, &result);
+    int before = nfonts;
+    for (int i = 0; set && i < set->nfont && nfonts < MAX_FONTS; i++) {
+        FcPattern *cand = FcFontRenderPrepare(NULL, pat, set->fonts[i]);
+        FcCharSet *cs;
+        if (cand && FcPatternGetCharSet(cand, FC_CHARSET, 0, &cs) == FcResultMatch) {
+            // Cached label segments hold indices into this list; the key notices it changing.
+            FcChar8 *family = NULL, *file = NULL;
+            int face = 0;
+            FcPatternGetString(cand, FC_FAMILY, 0, &family);
+            FcPatternGetString(cand, FC_FILE, 0, &file);
+            FcPatternGetInteger(cand, FC_INDEX, 0, &face);
+            fonts_sorted_key = fnv1a(fonts_sorted_key, family ? (char *)family : "", family ? strlen((char *)family) + 1 : 1);
+            fonts_sorted_key = fnv1a(fonts_sorted_key, file ? (char *)file : "", file ? strlen((char *)file) + 1 : 1);
+            fonts_sorted_key = fnv1a(fonts_sorted_key, &face, sizeof(face));
+            font_add(NULL, cand, cs);
+        } else if (cand)
+            FcPatternDestroy(cand);
+    }
+    if (set)
+        FcFontSetDestroy(set);
+    FcPatternDestroy(pat);
+    LOG("font", "%d fallback candidates from fontconfig", nfonts - before);
+}
+
+/* The font at a chain index, opening it if needed; the primary font if it cannot be. */
+static XftFont *font_at(int index) {
+    if (index >= nfonts && !fonts_sorted)
+        sort_fonts();
+    if (index <= 0 || index >= nfonts)
+        return xft_font;
+    struct FontSlot *f = &fonts[index];
+    if (!f->font && f->pattern) {
+        // XftFontOpenPattern takes the pattern; keep ours for its charset.
+        FcPattern *dup = FcPatternDuplicate(f->pattern);
+        f->font = XftFontOpenPattern(dpy, dup);
+        if (f->font) {
+            FcChar8 *family = NULL;
+            FcPatternGetString(f->pattern, FC_FAMILY, 0, &family);
+            LOG_DBG("font", "Opened fallback %d: %s", index, family ? (char *)family : "?");
+        } else {
+            FcPatternDestroy(dup);
+            FcPatternDestroy(f->pattern);
+            f->pattern = NULL;
+            f->charset = NULL;
+        }
+    }
+    return f->font ? f->font : xft_font;
+}
+
+/* Index of the first font in the chain with a glyph for c; 0 if none has one. */
+static int font_for(FcChar32 c) {
+    if (c >= 0x110000 || nfonts == 0)
+        return 0;
+    unsigned char **page = &coverage[c >> 8];
+    if (!*page && !(*page = calloc(256, 1)))
+        return 0;
+    unsigned char *slot = &(*page)[c & 0xFF];
+    if (*slot)
+        return *slot - 1;
+    int found = -1;
+    for (int i = 0; found < 0; i++) {
+        if (i >= nfonts) {
+            if (fonts_sorted)
+                break;
+            sort_fonts();
+            if (i >= nfonts)
+                break;
+        }
+        if (fonts[i].charset && FcCharSetHasChar(fonts[i].charset, c))
+            found = i;
+    }
+    if (found < 0)
+        found = 0;  // The primary font draws its missing-glyph box.
+    *slot = found + 1;
+    return found;
+}
+
+static void free_fonts(void) {
+    for (int i = 0; i < nfonts; i++) {
+        if (fonts[i].font)
+            XftFontClose(dpy, fonts[i].font);
+        if (fonts[i].pattern)
+            FcPatternDestroy(fonts[i].pattern);
+    }
+    free(fonts);
+    fonts = NULL;
+    nfonts = fonts_cap = 0;
+    fonts_sorted = 0;
+    fonts_sorted_key = 0;
+    for (size_t i = 0; i < sizeof(coverage) / sizeof(coverage[0]); i++) {
+        free(coverage[i]);
+        coverage[i] = NULL;
+    }
+    xft_font = arrow_font = NULL;
+}
+
+/* The item at index in the array for depth (0 is the top level). */
+static struct Item *item_at(int depth, int index) {
+    return depth == 0 ? &model.items[index] : &model.sub[depth - 1].v[index];
+}
+
+/* Parse one "label = command" line and attach it below the latest parent. */
+static void add_line(const char *line, size_t len, struct ParseState *ps) {
+    const char *end = line + len;
+    // Separator line
+    if (len == 3 && memcmp(line, "___", 3) == 0) {
+        model.items = grow(model.items, &model.items_cap, model.nitems + 1, sizeof(struct Item));
+        struct Item sep_item = {0};
+        sep_item.separator = 1;
+        model.items[model.nitems++] = sep_item;
+        ps->depth = 0;
+        return;
+    }
+
+    // Submenu lines start with "=="; each further "==" nests one level deeper.
+    int depth = 0;
+    const char *text = line;
+    while (end - text >= 2 && text[0] == '=' && text[1] == '=') {
+        depth++;
+        text += 2;
+    }
+    while (text < end && isspace((unsigned char)*text)) text++;
+    if (depth > ps->depth) {
+        parse_error(ps, line, "submenu entry at depth %d has no parent at depth %d", depth, depth - 1);
+        return;
+    }
+    if (depth > 0 && item_at(depth - 1, ps->path[depth - 1])->pipe) {
+        parse_error(ps, line, "pipe menu entries come from its command; this entry is ignored");
+        return;
+    }
+
+    // We expect "label = command", or "label |= command" for a pipe menu.
+    struct Item item = {0};
+    const char *delim = memmem(text, end - text, " = ", 3);
+    const char *pipe_delim = memmem(text, end - text, " |= ", 4);
+    const char *label_end = end, *cmd = end;
+    if (pipe_delim && (!delim || pipe_delim < delim)) {
+        label_end = pipe_delim;
+        cmd = pipe_delim + 4;
+        const char *c = cmd;
+        while (c < end && isspace((unsigned char)*c)) c++;
+        if (c == end)
+            parse_error(ps, pipe_delim + 1, "pipe menu has no command");  // Loaded as a plain entry.
+        else
+            item.pipe = 1;
+    } else if (delim) {
+        label_end = delim;
+        cmd = delim + 3;
+    }
+    item.output_len = end - cmd;
+    item.output = intern(cmd, item.output_len);
+    parse_label(text, label_end - text, &item, ps);
+    add_item(&item, depth, ps);
+}
+
+/* Report a malformed entry at the byte column of at in the current line. */
+static void parse_error(struct ParseState *ps, const char *at, const char *fmt, ...) {
+    if (!ps || !ps->file)
+        return;
+    parse_errors++;
+    if (ps->errors++ >= MAX_PARSE_ERRORS)
+        return;
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    LOG_WARNING("parse", "%s:%d:%d: %s", ps->file, ps->line, (int)(at - ps->line_start) + 1, msg);
+}
+
+/* Parse item lines from [buf, buf + len) in place; the buffer needs no terminator. */
+static void parse_items(const char *buf, size_t len, struct ParseState *ps) {
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        ps->line++;
+        ps->line_start = p;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        const char *s = p;
+        while (s < eol && (*s == ' ' || *s == '\t')) s++;
+        if (s < eol)
+            add_line(p, eol - p, ps);
+        p = nl ? nl + 1 : end;
+    }
+    if (ps->errors > MAX_PARSE_ERRORS)
+        LOG_WARNING("parse", "%s: %d more errors not shown", ps->file, ps->errors - MAX_PARSE_ERRORS);
+}
+
+/* Map a file read-only, or read it in when it cannot be mapped (a pipe, say). */
+static int map_file(const char *path, struct Mapping *m) {
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            m->data = "";
+            return 1;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            m->data = p;
+            m->len = st.st_size;
+            m->mapped = 1;
+            return 1;
+        }
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    for (;;) {
+        if (m->len == cap) {
+            cap = cap ? cap * 2 : 65536;
+            if (!(buf = realloc(buf, cap))) {
+                fprintf(stderr, "gmenu: Memory allocation failed reading %s\n", path);
+                exit(1);
+            }
+        }
+        ssize_t n = read(fd, buf + m->len, cap - m->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        m->len += n;
+    }
+    close(fd);
+    m->data = buf;
+    m->owned = 1;
+    return 1;
+}
+
+static void unmap_file(struct Mapping *m) {
+    if (m->mapped)
+        munmap((void *)m->data, m->len);
+    else if (m->owned)
+        free((void *)m->data);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Place an item at depth, under the most recent item one level up. */
+static void add_item(struct Item *item, int depth, struct ParseState *ps) {
+    int index;
+    if (depth == 0) {
+        // top-level item
+        model.items = grow(model.items, &model.items_cap, model.nitems + 1, sizeof(struct Item));
+        model.items[model.nitems++] = *item;
+        index = model.nitems - 1;
+    } else {
+        if (depth > model.nsub) {
+            model.sub = grow(model.sub, &model.sub_cap, depth, sizeof(struct ItemArray));
+            memset(&model.sub[model.nsub], 0, (depth - model.nsub) * sizeof(struct ItemArray));
+            model.nsub = depth;
+        }
+        struct ItemArray *a = &model.sub[depth - 1];
+        struct Item *p = item_at(depth - 1, ps->path[depth - 1]);
+        if (p->nsubitems == 0)
+            p->sub_first = a->n;
+        a->v = grow(a->v, &a->cap, a->n + 1, sizeof(struct Item));
+        a->v[a->n++] = *item;
+        p->nsubitems++;
+        index = a->n - 1;
+    }
+    ps->path = grow(ps->path, &ps->cap, depth + 1, sizeof(int));
+    ps->path[depth] = index;
+    ps->depth = depth + 1;
+}
+
+static void read_input(const char *path) {
+    static const char fallback[] =  // If there is no .gmenu_items
+        "File Manager = thunar\n"
+        "Reboot = reboot\n"
+        "Shutdown = poweroff\n";
+    struct ParseState ps = {0};
+    struct Mapping m;
+    int found = map_file(path, &m);
+    load_started = monotonic_now();
+    parse_errors = 0;
+    menu_cache_key = menu_cache_hash(found ? m.data : NULL, m.len);
+    last_load_cached = load_menu_cache(menu_cache_key);
+    if (last_load_cached) {
+        unmap_file(&m);
+        model_from_cache = 1;
+        fixup_submenus();
+        return;
+    }
+    menu_cache_stale = 1;
+
+    if (found) {
+        ps.file = path;
+        parse_items(m.data, m.len, &ps);
+        unmap_file(&m);
+    } else {
+        parse_items(fallback, sizeof(fallback) - 1, &ps);
+    }
+    if (config.applications)
+        read_applications(&ps);
+    free(ps.path);
+    fixup_submenus();
+}
+
+/* The arrays are final now, so submenu pointers stay valid. */
+static void fixup_submenus(void) {
+    int nsubitems = 0;
+    for (int d = 0; d < model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (it->nsubitems > 0 && !it->pipe)
+                it->submenu = model.sub[d].v + it->sub_first;
+        }
+        nsubitems += model.sub[d].n;
+    }
+    icons_attach();
+    pipe_attach();
+    LOG("menu", "Loaded %d items, %d subitems in %d levels, %zu bytes of labels",
+        model.nitems, nsubitems, model.nsub, model.strings_len);
+}
+
+/*
+ * Applications from the XDG .desktop files, grouped by category under one
+ * "Applications" item. Files are parsed on a small thread pool and the
+ * result is written to a binary index in the cache directory; later starts
+ * mmap that index and only rescan when one of the application directories
+ * has a different mtime, i.e. a file was added, removed or renamed there.
+ */
+#define APP_CACHE_MAGIC 0x50414d47  // "GMAP"
+#define APP_CACHE_VERSION 1
+#define MAX_INDEX_THREADS 8
+
+struct AppCacheHeader {
+    uint32_t magic, version;
+    uint32_t ndirs, nentries;
+    uint32_t strings_len;
+    uint32_t reserved;
+};
+
+struct AppCacheDir {
+    int64_t mtime_sec, mtime_nsec;  // -1 if the directory does not exist.
+    uint32_t path;                  // Offsets are into the string table.
+    uint32_t reserved;
+};
+
+struct AppCacheEntry {
+    uint32_t name, exec;
+    uint32_t category;              // Index into app_category_labels.
+};
+
+/* One .desktop file, filled in by an indexer thread. */
+struct DesktopEntry {
+    char *path;
+    const char *id;     // Desktop file ID, the basename; points into path.
+    int order;          // Position of its directory in the search path.
+    int category;       // -1: not shown.
+    char name[128];
+    char exec[512];
+};
+
+struct IndexJob {
+    struct DesktopEntry *entries;
+    int n;
+    int next;           // Next entry to parse, taken atomically by workers.
+};
+
+static const char *app_category_labels[] = {
+    "Accessories", "Development", "Education", "Games", "Graphics", "Internet",
+    "Multimedia", "Office", "Science", "Settings", "System", "Other"
+};
+#define APP_CATEGORY_OTHER 11
+
+/* Main categories from the menu specification, first match wins. */
+static const struct { const char *name; int label; } app_categories[] = {
+    {"AudioVideo", 6}, {"Audio", 6}, {"Video", 6}, {"Development", 1},
+    {"Education", 2}, {"Game", 3}, {"Graphics", 4}, {"Network", 5},
+    {"Office", 7}, {"Science", 8}, {"Settings", 9}, {"System", 10},
+    {"Utility", 0}
+};
+
+static int app_category(const char *list) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *save, *tok = strtok_r(buf, ";", &save); tok; tok = strtok_r(NULL, ";", &save))
+        for (size_t i = 0; i < sizeof(app_categories) / sizeof(app_categories[0]); i++)
+            if (strcmp(tok, app_categories[i].name) == 0)
+                return app_categories[i].label;
+    return APP_CATEGORY_OTHER;
+}
+
+/* Copy an Exec value, dropping the %f/%u/... field codes gmenu has no use for. */
+static void copy_exec(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+    for (; *src && n + 1 < size; src++) {
+        if (*src == '%' && src[1]) {
+            if (src[1] == '%')
+                dst[n++] = '%';
+            src++;
+            continue;
+        }
+        dst[n++] = *src;
+    }
+    while (n > 0 && isspace((unsigned char)dst[n - 1]))
+        n--;
+    dst[n] = '\0';
+}
+
+/* Read the [Desktop Entry] group of one file. Runs on the indexer threads. */
+static void parse_desktop_file(struct DesktopEntry *e) {
+    e->category = -1;
+    e->name[0] = e->exec[0] = '\0';
+    FILE *fp = fopen(e->path, "re");
+    if (!fp)
+        return;
+
+    char line[1024], categories[256] = "";
+    int in_entry = 0, is_app = 0, hidden = 0, terminal = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '[') {
+            if (in_entry)
+                break;
+            in_entry = strcmp(line, "[Desktop Entry]") == 0;
+            continue;
+        }
+        char *eq = strchr(line, '=');
+        if (!in_entry || !eq)
+            continue;
+        char *key_end = eq;
+        while (key_end > line && isspace((unsigned char)key_end[-1]))
+            key_end--;
+        *key_end = '\0';
+        char *value = eq + 1;
+        while (isspace((unsigned char)*value))
+            value++;
+
+        if (strcmp(line, "Name") == 0)
+            snprintf(e->name, sizeof(e->name), "%s", value);
+        else if (strcmp(line, "Exec") == 0)
+            copy_exec(e->exec, sizeof(e->exec), value);
+        else if (strcmp(line, "Categories") == 0)
+            snprintf(categories, sizeof(categories), "%s", value);
+        else if (strcmp(line, "Type") == 0)
+            is_app = strcmp(value, "Application") == 0;
+        else if (strcmp(line, "NoDisplay") == 0 || strcmp(line, "Hidden") == 0)
+            hidden |= strcmp(value, "true") == 0;
+        else if (strcmp(line, "Terminal") == 0)
+            terminal = strcmp(value, "true") == 0;
+    }
+    fclose(fp);
+
+    if (!is_app || hidden || !e->name[0] || !e->exec[0])
+        return;
+    if (terminal) {
+        char cmd[sizeof(e->exec)];
+        memcpy(cmd, e->exec, sizeof(cmd));
+        if (snprintf(e->exec, sizeof(e->exec), "%s %s", TERMINAL, cmd) >= (int)sizeof(e->exec))
+            return;  // a cut-off command line would run something else
+    }
+    e->category = app_category(categories);
+}
+
+static void *index_worker(void *arg) {
+    struct IndexJob *job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+        parse_desktop_file(&job->entries[i]);
+    return NULL;
+}
+
+/* $XDG_DATA_HOME/applications, then each of $XDG_DATA_DIRS, in priority order. */
+static int app_dirs(char ***dirs) {
+    int n = 0, cap = 0;
+    const char *home = getenv("HOME");
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+    char path[PATH_MAX];
+
+    if (data_home && *data_home)
+        snprintf(path, sizeof(path), "%s/applications", data_home);
+    else
+        snprintf(path, sizeof(path), "%s/.local/share/applications", home);
+    *dirs = grow(NULL, &cap, 1, sizeof(char *));
+    (*dirs)[n++] = strdup(path);
+
+    char *list = strdup(data_dirs && *data_dirs ? data_dirs : "/usr/local/share:/usr/share");
+    for (char *save, *d = strtok_r(list, ":", &save); d; d = strtok_r(NULL, ":", &save)) {
+        snprintf(path, sizeof(path), "%s/applications", d);
+        *dirs = grow(*dirs, &cap, n + 1, sizeof(char *));
+        (*dirs)[n++] = strdup(path);
+    }
+    free(list);
+    return n;
+}
+
+static void dir_mtime(const char *path, struct AppCacheDir *d) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        d->mtime_sec = st.st_mtim.tv_sec;
+        d->mtime_nsec = st.st_mtim.tv_nsec;
+    } else {
+        d->mtime_sec = d->mtime_nsec = -1;
+    }
+}
+
+static int compare_desktop_ids(const void *a, const void *b) {
+    const struct DesktopEntry *x = a, *y = b;
+    int c = strcmp(x->id, y->id);
+    return c ? c : x->order - y->order;
+}
+
+static int compare_desktop_entries(const void *a, const void *b) {
+    const struct DesktopEntry *x = a, *y = b;
+    if (x->category != y->category)
+        return x->category - y->category;
+    return strcasecmp(x->name, y->name);
+}
+
+/* Append n bytes to a growable buffer and return their offset. */
+static uint32_t buf_put(char **buf, int *cap, int *len, const void *data, int n) {
+    *buf = grow(*buf, cap, *len + n, 1);
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return *len - n;
+}
+
+/*
+ * Scan and parse every .desktop file and return the index image, laid out
+ * exactly as it is stored in the cache file.
+ */
+static char *build_app_index(char **dirs, int ndirs, size_t *size) {
+    struct DesktopEntry *entries = NULL;
+    int n = 0, cap = 0;
+    for (int d = 0; d < ndirs; d++) {
+        DIR *dp = opendir(dirs[d]);
+        if (!dp)
+            continue;
+        struct dirent *de;
+        while ((de = readdir(dp))) {
+            size_t len = strlen(de->d_name);
+            if (len <= 8 || strcmp(de->d_name + len - 8, ".desktop") != 0)
+                continue;
+            entries = grow(entries, &cap, n + 1, sizeof(struct DesktopEntry));
+            struct DesktopEntry *e = &entries[n++];
+            size_t size = strlen(dirs[d]) + len + 2;
+            if (!(e->path = malloc(size))) {
+                fprintf(stderr, "gmenu: Memory allocation failed for applications\n");
+                exit(1);
+            }
+            snprintf(e->path, size, "%s/%s", dirs[d], de->d_name);
+            e->id = e->path + strlen(dirs[d]) + 1;
+            e->order = d;
+        }
+        closedir(dp);
+    }
+
+    // A desktop file ID found in several directories: the first one wins.
+    qsort(entries, n, sizeof(struct DesktopEntry), compare_desktop_ids);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique > 0 && strcmp(entries[unique - 1].id, entries[i].id) == 0)
+            free(entries[i].path);
+        else
+            entries[unique++] = entries[i];
+    }
+    n = unique;
+
+    struct IndexJob job = { entries, n, 0 };
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : ncpu > MAX_INDEX_THREADS ? MAX_INDEX_THREADS : ncpu;
+    if (nthreads > n / 16 + 1)
+        nthreads = n / 16 + 1;  // not worth a thread per handful of files
+    pthread_t threads[MAX_INDEX_THREADS];
+    int started = 0;
+    for (; started < nthreads - 1; started++)
+        if (pthread_create(&threads[started], NULL, index_worker, &job) != 0)
+            break;
+    index_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    qsort(entries, n, sizeof(struct DesktopEntry), compare_desktop_entries);
+
+    char *strings = NULL;
+    int strings_len = 0, strings_cap = 0;
+    struct AppCacheHeader h = { APP_CACHE_MAGIC, APP_CACHE_VERSION, ndirs, 0, 0, 0 };
+    struct AppCacheDir *cdirs = calloc(ndirs, sizeof(struct AppCacheDir));
+    struct AppCacheEntry *centries = calloc(n ? n : 1, sizeof(struct AppCacheEntry));
+    for (int d = 0; d < ndirs; d++) {
+        dir_mtime(dirs[d], &cdirs[d]);
+        cdirs[d].path = buf_put(&strings, &strings_cap, &strings_len, dirs[d], strlen(dirs[d]) + 1);
+    }
+    for (int i = 0; i < n; i++) {
+        struct DesktopEntry *e = &entries[i];
+        if (e->category >= 0) {
+            struct AppCacheEntry *c = &centries[h.nentries++];
+            c->name = buf_put(&strings, &strings_cap, &strings_len, e->name, strlen(e->name) + 1);
+            c->exec = buf_put(&strings, &strings_cap, &strings_len, e->exec, strlen(e->exec) + 1);
+            c->category = e->category;
+        }
+        free(e->path);
+    }
+    free(entries);
+    h.strings_len = strings_len;
+
+    char *index = NULL;
+    int len = 0, index_cap = 0;
+    buf_put(&index, &index_cap, &len, &h, sizeof(h));
+    buf_put(&index, &index_cap, &len, cdirs, ndirs * sizeof(struct AppCacheDir));
+    buf_put(&index, &index_cap, &len, centries, h.nentries * sizeof(struct AppCacheEntry));
+    buf_put(&index, &index_cap, &len, strings, strings_len);
+    free(cdirs);
+    free(centries);
+    free(strings);
+    *size = len;
+    return index;
+}
+
+/* Check an index image for consistency and against the current directories. */
+static int app_index_valid(const char *index, size_t size, char **dirs, int ndirs) {
+    const struct AppCacheHeader *h = (const void *)index;
+    if (size < sizeof(*h) || h->magic != APP_CACHE_MAGIC ||
+        h->version != APP_CACHE_VERSION || h->ndirs != (uint32_t)ndirs)
+        return 0;
+    size_t want = sizeof(*h) + (size_t)h->ndirs * sizeof(struct AppCacheDir) +
+                  (size_t)h->nentries * sizeof(struct AppCacheEntry) + h->strings_len;
+    if (size != want || h->strings_len == 0)
+        return 0;
+    const struct AppCacheDir *cdirs = (const void *)(h + 1);
+    const struct AppCacheEntry *centries = (const void *)(cdirs + h->ndirs);
+    const char *strings = (const char *)(centries + h->nentries);
+    if (strings[h->strings_len - 1] != '\0')
+        return 0;
+    for (int d = 0; d < ndirs; d++) {
+        struct AppCacheDir now;
+        dir_mtime(dirs[d], &now);
+        if (cdirs[d].path >= h->strings_len || strcmp(strings + cdirs[d].path, dirs[d]) != 0 ||
+            cdirs[d].mtime_sec != now.mtime_sec || cdirs[d].mtime_nsec != now.mtime_nsec)
+            return 0;
+    }
+    for (uint32_t i = 0; i < h->nentries; i++)
+        if (centries[i].name >= h->strings_len || centries[i].exec >= h->strings_len ||
+            centries[i].category > APP_CATEGORY_OTHER)
+            return 0;
+    return 1;
+}
+
+static void add_app_item(const char *label, const char *cmd, int depth, struct ParseState *ps) {
+    struct Item item = {0};
+    item.output_len = strlen(cmd);
+    item.output = intern(cmd, item.output_len);
+    parse_label(label, strlen(label), &item, NULL);
+    add_item(&item, depth, ps);
+}
+
+/* Add the "Applications" submenu from the cached index, rebuilding it if stale. */
+static void read_applications(struct ParseState *ps) {
+    double start = monotonic_now();
+    char **dirs;
+    int ndirs = app_dirs(&dirs);
+    char cache_path[PATH_MAX];
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home && *cache_home)
+        snprintf(cache_path, sizeof(cache_path), "%s/gmenu", cache_home);
+    else
+        snprintf(cache_path, sizeof(cache_path), "%s/.cache/gmenu", getenv("HOME"));
+
+    char *index = NULL;
+    size_t size = 0;
+    int mapped = 0;
+    char file[PATH_MAX + 32];
+    snprintf(file, sizeof(file), "%s/applications.idx", cache_path);
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        index = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        size = st.st_size;
+        if (index == MAP_FAILED) {
+            index = NULL;
+        } else if (app_index_valid(index, size, dirs, ndirs)) {
+            mapped = 1;
+        } else {
+            munmap(index, size);
+            index = NULL;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (!index) {
+        index = build_app_index(dirs, ndirs, &size);
+        mkdir(cache_path, 0755);
+        if (write_atomically(file, index, size) != 0)
+            LOG_WARNING("apps", "Could not write application index %s", file);
+    }
+
+    const struct AppCacheHeader *h = (const void *)index;
+    const struct AppCacheDir *cdirs = (const void *)(h + 1);
+    const struct AppCacheEntry *centries = (const void *)(cdirs + h->ndirs);
+    const char *strings = (const char *)(centries + h->nentries);
+    if (h->nentries > 0) {
+        add_app_item("Applications", "", 0, ps);
+        int category = -1;
+        for (uint32_t i = 0; i < h->nentries; i++) {
+            if ((int)centries[i].category != category) {
+                category = centries[i].category;
+                add_app_item(app_category_labels[category], "", 1, ps);
+            }
+            add_app_item(strings + centries[i].name, strings + centries[i].exec, 2, ps);
+        }
+    }
+    LOG("apps", "%u entries %s in %.1f ms", h->nentries,
+        mapped ? "from the index" : "scanned", (monotonic_now() - start) * 1000);
+
+    if (mapped)
+        munmap(index, size);
+    else
+        free(index);
+    for (int d = 0; d < ndirs; d++)
+        free(dirs[d]);
+    free(dirs);
+}
+
+/*
+ * Compiled menu cache, kept next to the item file. It holds the whole
+ * model as loaded and measured, so a start whose item file, config and
+ * font match the key can skip parsing, color resolution and text
+ * measurement. Widths that depend only on padding are recomputed.
+ */
+#define MENU_CACHE_MAGIC 0x434d4d47  // "GMMC"
+#define MENU_CACHE_VERSION 4
+
+struct MenuCacheHeader {
+    uint32_t magic, version;
+    uint64_t key;
+    uint32_t nitems, nsegments, nsub;
+    uint32_t strings_len;
+    uint32_t parse_errors;   // Found when the items were parsed; reported again by --stats.
+    uint64_t fonts_key;      // fonts_sorted_key if parsing needed fontconfig's candidates, else 0.
+    // Followed by nsub uint32_t counts, the strings, the segments, the
+    // top-level items and the items of each depth.
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Everything the cached model depends on: item file, parse-time config, font and visual. */
+static uint64_t menu_cache_hash(const char *items, size_t len) {
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, "gmenu", 5);
+    uint32_t layout[] = { MENU_CACHE_VERSION, sizeof(struct Item), sizeof(struct LabelSegment) };
+    h = fnv1a(h, layout, sizeof(layout));
+    h = items ? fnv1a(h, items, len) : fnv1a(h, "(fallback)", 10);
+
+    h = fnv1a(h, &config.fg, sizeof(config.fg));
+    h = fnv1a(h, &config.icon_right_padding, sizeof(config.icon_right_padding));
+    h = fnv1a(h, &config.applications, sizeof(config.applications));
+    if (config.applications) {
+        char **dirs;
+        int ndirs = app_dirs(&dirs);
+        for (int d = 0; d < ndirs; d++) {
+            struct AppCacheDir stamp = {0};
+            dir_mtime(dirs[d], &stamp);
+            h = fnv1a(h, dirs[d], strlen(dirs[d]) + 1);
+            h = fnv1a(h, &stamp, sizeof(stamp));
+            free(dirs[d]);
+        }
+        free(dirs);
+    }
+
+    // The resolved pattern names the font file, size and rendering options.
+    char font[2048];
+    if (XftNameUnparse(xft_font->pattern, font, sizeof(font)))
+        h = fnv1a(h, font, strlen(font));
+    else
+        h = fnv1a(h, config.font, strlen(config.font));
+    h = fnv1a(h, config.font_fallback, strlen(config.font_fallback));
+    unsigned long masks[] = { menu_vi.red_mask, menu_vi.green_mask, menu_vi.blue_mask };
+    h = fnv1a(h, masks, sizeof(masks));
+    return h;
+}
+
+static void menu_cache_file(char *file, size_t size) {
+    snprintf(file, size, "%s.cache", items_path);
+}
+
+/* Copy n elements out of a cache image into a new growable array. */
+static void *copy_array(const char **p, int n, size_t size, int *cap) {
+    void *v = grow(NULL, cap, n > 0 ? n : 1, size);
+    memcpy(v, *p, (size_t)n * size);
+    *p += (size_t)n * size;
+    return v;
+}
+
+/* Load the model from the cache if its key matches; 0 if it had to be parsed. */
+static int load_menu_cache(uint64_t key) {
+    char file[PATH_MAX + 8];
+    menu_cache_file(file, sizeof(file));
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct MenuCacheHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    const struct MenuCacheHeader *h = map;
+    int ok = h->magic == MENU_CACHE_MAGIC && h->version == MENU_CACHE_VERSION && h->key == key;
+    if (ok && h->fonts_key) {
+        // Segments may point past the configured fonts; sort now, as painting them would.
+        if (!fonts_sorted)
+            sort_fonts();
+        ok = h->fonts_key == fonts_sorted_key;
+    }
+    const char *p = (const char *)(h + 1);
+    size_t want = sizeof(*h) + (size_t)h->nsub * sizeof(uint32_t);
+    uint32_t total_sub = 0;
+    if (ok && want <= (size_t)st.st_size) {
+        for (uint32_t d = 0; d < h->nsub; d++) {
+            uint32_t n;
+            memcpy(&n, p + d * sizeof(n), sizeof(n));
+            total_sub += n;
+        }
+        want += h->strings_len + (size_t)h->nsegments * sizeof(struct LabelSegment) +
+                ((size_t)h->nitems + total_sub) * sizeof(struct Item);
+    }
+    if (!ok || want != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    uint32_t *counts = malloc((h->nsub ? h->nsub : 1) * sizeof(uint32_t));
+    memcpy(counts, p, h->nsub * sizeof(uint32_t));
+    p += h->nsub * sizeof(uint32_t);
+
+    model.strings = malloc(h->strings_len ? h->strings_len : 1);
+    if (!model.strings || !counts) {
+        fprintf(stderr, "gmenu: Memory allocation failed for labels\n");
+        exit(1);
+    }
+    memcpy(model.strings, p, h->strings_len);
+    model.strings_len = model.strings_cap = h->strings_len;
+    p += h->strings_len;
+    model.nsegments = h->nsegments;
+    model.segments = copy_array(&p, h->nsegments, sizeof(struct LabelSegment), &model.segments_cap);
+    model.nitems = h->nitems;
+    model.items = copy_array(&p, h->nitems, sizeof(struct Item), &model.items_cap);
+    model.nsub = h->nsub;
+    model.sub = grow(NULL, &model.sub_cap, h->nsub > 0 ? h->nsub : 1, sizeof(struct ItemArray));
+    for (uint32_t d = 0; d < h->nsub; d++) {
+        struct ItemArray *a = &model.sub[d];
+        a->cap = 0;
+        a->n = counts[d];
+        a->v = copy_array(&p, counts[d], sizeof(struct Item), &a->cap);
+    }
+    free(counts);
+    parse_errors = h->parse_errors;
+    munmap(map, st.st_size);
+    return 1;
+}
+
+/* Write an image to path through a temporary file, so readers never see half of it. */
+static int write_atomically(const char *path, const void *data, size_t size) {
+    char tmp[PATH_MAX + 48];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wbe");
+    if (!fp)
+        return -1;
+    int ok = fwrite(data, 1, size, fp) == size;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Append items to a cache image without the pointers, which are rebuilt on load. */
+static void put_items(char **buf, int *cap, int *len, const struct Item *items, int n) {
+    for (int i = 0; i < n; i++) {
+        struct Item it = items[i];
+        it.submenu = NULL;
+        it.popup = NULL;
+        it.submenu_gen = 0;
+        buf_put(buf, cap, len, &it, sizeof(it));
+    }
+}
+
+/* Measure every submenu and store the finished model under key. */
+static void save_menu_cache(uint64_t key) {
+    for (int d = 0; d < model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++)
+            if (item_at(d, i)->nsubitems > 0)
+                layout_submenu(item_at(d, i));
+    }
+
+    struct MenuCacheHeader h = { MENU_CACHE_MAGIC, MENU_CACHE_VERSION, key,
+                                 model.nitems, model.nsegments, model.nsub, model.strings_len,
+                                 parse_errors, fonts_sorted_key };
+    char *buf = NULL;
+    int cap = 0, len = 0;
+    buf_put(&buf, &cap, &len, &h, sizeof(h));
+    for (int d = 0; d < model.nsub; d++) {
+        uint32_t n = model.sub[d].n;
+        buf_put(&buf, &cap, &len, &n, sizeof(n));
+    }
+    buf_put(&buf, &cap, &len, model.strings, model.strings_len);
+    buf_put(&buf, &cap, &len, model.segments, model.nsegments * sizeof(struct LabelSegment));
+    put_items(&buf, &cap, &len, model.items, model.nitems);
+    for (int d = 0; d < model.nsub; d++)
+        put_items(&buf, &cap, &len, model.sub[d].v, model.sub[d].n);
+
+    char file[PATH_MAX + 8];
+    menu_cache_file(file, sizeof(file));
+    if (write_atomically(file, buf, len) != 0)
+        LOG_WARNING("cache", "Could not write menu cache %s", file);
+    free(buf);
+}
+
+/*
+ * Launch history. Every launch appends a fixed-size record to usage.log;
+ * the log is folded into one record per command when gmenu starts, so its
+ * length tracks the number of distinct commands rather than launches. In
+ * memory the scores live in a hash table keyed by the command's hash.
+ */
+#define RECENT_HALF_LIFE_DAYS 3.0
+#define USAGE_MAX_ENTRIES 512
+#define USAGE_MIN_SCORE 0.05
+
+struct UsageRecord {
+    uint64_t hash;   // fnv1a of the command.
+    int64_t time;    // Seconds since the epoch.
+    double weight;   // 1 per launch; a compacted record carries the decayed sum.
+};
+
+struct Usage {
+    uint64_t hash;   // 0: empty slot.
+    int64_t time;
+    double score;    // Value at time; decays by RECENT_HALF_LIFE_DAYS.
+};
+
+static double usage_decay(int64_t from, int64_t to) {
+    return exp2(-(double)(to - from) / (RECENT_HALF_LIFE_DAYS * 86400));
+}
+
+static uint64_t command_hash(const char *cmd) {
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, cmd, strlen(cmd));
+    return h ? h : 1;  // 0 marks an empty slot
+}
+
+static struct Usage *usage_slot(uint64_t hash) {
+    unsigned int mask = usage_cap - 1;
+    for (unsigned int i = hash & mask; ; i = (i + 1) & mask)
+        if (usage[i].hash == hash || usage[i].hash == 0)
+            return &usage[i];
+}
+
+/* Fold one launch (or compacted record) into the table. */
+static void usage_add(uint64_t hash, int64_t time, double weight) {
+    if (nusage + 1 > usage_cap * 7 / 10) {
+        struct Usage *old = usage;
+        int old_cap = usage_cap;
+        usage_cap = usage_cap ? usage_cap * 2 : 64;
+        usage = calloc(usage_cap, sizeof(struct Usage));
+        if (!usage) {
+            fprintf(stderr, "gmenu: Memory allocation failed for launch history\n");
+            exit(1);
+        }
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].hash)
+                *usage_slot(old[i].hash) = old[i];
+        free(old);
+    }
+    struct Usage *u = usage_slot(hash);
+    if (u->hash == 0) {
+        u->hash = hash;
+        u->time = time;
+        u->score = 0;
+        nusage++;
+    }
+    if (time >= u->time) {
+        u->score = u->score * usage_decay(u->time, time) + weight;
+        u->time = time;
+    } else {
+        u->score += weight * usage_decay(time, u->time);
+    }
+}
+
+static int compare_usage(const void *a, const void *b) {
+    const struct Usage *x = a, *y = b;
+    return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+/* Entries by score as of now, best first; the caller frees the array. */
+static struct Usage *usage_ranked(int *n) {
+    int64_t now = time(NULL);
+    struct Usage *ranked = malloc((nusage ? nusage : 1) * sizeof(struct Usage));
+    *n = 0;
+    for (int i = 0; i < usage_cap; i++) {
+        if (!usage[i].hash)
+            continue;
+        ranked[*n] = usage[i];
+        ranked[*n].score *= usage_decay(usage[i].time, now);
+        ranked[*n].time = now;
+        (*n)++;
+    }
+    qsort(ranked, *n, sizeof(struct Usage), compare_usage);
+    return ranked;
+}
+
+/* Read and compact the log, then keep it open for appending. */
+static void usage_load(void) {
+    const char *state = getenv("XDG_STATE_HOME");
+    char dir[PATH_MAX];
+    if (state && *state)
+        snprintf(dir, sizeof(dir), "%s/gmenu", state);
+    else
+        snprintf(dir, sizeof(dir), "%s/.local/state/gmenu", getenv("HOME"));
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+    mkdir(dir, 0755);
+    snprintf(usage_path, sizeof(usage_path), "%s/usage.log", dir);
+
+    FILE *fp = fopen(usage_path, "rbe");
+    int nrecords = 0;
+    if (fp) {
+        struct UsageRecord r;
+        // A torn record at the end, from a crash mid-append, is dropped.
+        while (fread(&r, sizeof(r), 1, fp) == 1) {
+            if (r.hash && r.weight > 0)
+                usage_add(r.hash, r.time, r.weight);
+            nrecords++;
+        }
+        fclose(fp);
+    }
+
+    int n;
+    struct Usage *ranked = usage_ranked(&n);
+    if (n > USAGE_MAX_ENTRIES)
+        n = USAGE_MAX_ENTRIES;
+    while (n > 0 && ranked[n - 1].score < USAGE_MIN_SCORE)
+        n--;
+    struct UsageRecord *records = malloc((n ? n : 1) * sizeof(struct UsageRecord));
+    if (usage)
+        memset(usage, 0, usage_cap * sizeof(struct Usage));
+    nusage = 0;
+    for (int i = 0; i < n; i++) {
+        struct UsageRecord r = { ranked[i].hash, ranked[i].time, ranked[i].score };
+        records[i] = r;
+        usage_add(r.hash, r.time, r.weight);
+    }
+    if (n != nrecords && write_atomically(usage_path, records, n * sizeof(struct UsageRecord)) != 0)
+        LOG_WARNING("history", "Could not compact %s", usage_path);
+    free(records);
+    free(ranked);
+
+    usage_fd = open(usage_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    LOG("history", "%d records compacted to %d", nrecords, n);
+}
+
+/* Called on every launch: one append and one table update, never a sync. */
+static void usage_record(const char *cmd) {
+    if (config.recent_items <= 0)
+        return;
+    struct UsageRecord r = { command_hash(cmd), time(NULL), 1.0 };
+    usage_add(r.hash, r.time, r.weight);
+    if (usage_fd >= 0 && write(usage_fd, &r, sizeof(r)) != sizeof(r))
+        LOG_WARNING("history", "Could not append to %s", usage_path);
+    recent_dirty = 1;
+}
+
+/*
+ * Rebuild the "Recent" submenu at the top of the menu from the best-scoring
+ * commands that are still in it. Only called while the menu is closed, as
+ * it moves the top-level items.
+ */
+static void update_recent_menu(void) {
+    recent_dirty = 0;
+    if (recent_rows > 0) {
+        struct Item *r = &model.items[0];
+        if (r->popup) {
+            spare_popups = grow(spare_popups, &spare_popups_cap, nspare_popups + 1,
+                                sizeof(struct Surface *));
+            spare_popups[nspare_popups++] = r->popup;
+        }
+        model.nitems -= recent_rows;
+        memmove(model.items, model.items + recent_rows, model.nitems * sizeof(struct Item));
+        recent_rows = 0;
+    }
+    free_search_index();  // holds pointers into model.items
+
+    nrecent = 0;
+    if (config.recent_items > 0 && nusage > 0) {
+        // Index the menu's commands by hash, so each history entry is one probe.
+        int total = 0;
+        for (int d = 0; d <= model.nsub; d++)
+            total += d == 0 ? model.nitems : model.sub[d - 1].n;
+        unsigned int cap = 16;
+        while (cap < 2u * total)
+            cap *= 2;
+        struct { uint64_t hash; struct Item *item; } *by_hash = calloc(cap, sizeof(*by_hash));
+        if (!by_hash) {
+            fprintf(stderr, "gmenu: Memory allocation failed for launch history\n");
+            exit(1);
+        }
+        for (int d = 0; d <= model.nsub; d++) {
+            int count = d == 0 ? model.nitems : model.sub[d - 1].n;
+            for (int i = 0; i < count; i++) {
+                struct Item *it = item_at(d, i);
+                if (it->nsubitems > 0 || it->output_len == 0)
+                    continue;
+                uint64_t h = command_hash(STR(it->output));
+                unsigned int k = h & (cap - 1);
+                while (by_hash[k].hash && by_hash[k].hash != h)
+                    k = (k + 1) & (cap - 1);
+                if (!by_hash[k].hash) {  // the first item with a command wins
+                    by_hash[k].hash = h;
+                    by_hash[k].item = it;
+                }
+            }
+        }
+
+        int n;
+        struct Usage *ranked = usage_ranked(&n);
+        recent_items = grow(recent_items, &recent_cap, config.recent_items, sizeof(struct Item));
+        for (int r = 0; r < n && nrecent < config.recent_items; r++) {
+            if (ranked[r].score < USAGE_MIN_SCORE)
+                break;
+            unsigned int k = ranked[r].hash & (cap - 1);
+            while (by_hash[k].hash && by_hash[k].hash != ranked[r].hash)
+                k = (k + 1) & (cap - 1);
+            if (by_hash[k].hash) {
+                recent_items[nrecent] = *by_hash[k].item;
+                recent_items[nrecent++].popup = NULL;
+            }
+        }
+        free(ranked);
+        free(by_hash);
+    }
+
+    if (nrecent > 0) {
+        model.items = grow(model.items, &model.items_cap, model.nitems + 2, sizeof(struct Item));
+        memmove(model.items + 2, model.items, model.nitems * sizeof(struct Item));
+        struct Item recent = {0}, sep = {0};
+        if (!recent_label) {
+            // Parsed once per model; later updates reuse its label segment.
+            recent_label = calloc(1, sizeof(struct Item));
+            recent_label->output = intern("", 0);
+            parse_label("Recent", 6, recent_label, NULL);
+        }
+        recent.output = recent_label->output;
+        recent.seg_first = recent_label->seg_first;
+        recent.nsegments = recent_label->nsegments;
+        recent.submenu = recent_items;
+        recent.nsubitems = nrecent;
+        layout_item(&recent);
+        sep.separator = 1;
+        model.items[0] = recent;
+        model.items[1] = sep;
+        model.nitems += 2;
+        recent_rows = 2;
+    }
+
+    calculate_menu_width();
+    menuheight = capped_rows(model.nitems) * itemheight + 2 * config.border_width + 4;
+    if (nlevels > 0) {
+        levels[0].items = model.items;
+        levels[0].nitems = model.nitems;
+        levels[0].top = 0;
+    }
+}
+
+/*
+ * Pipe menus: "Label |= command" gets its submenu from the command's
+ * output, one "label = command" (or "___") line per entry. The command
+ * runs in the background with its stdout read from run(); the last output
+ * is kept and shown at once, and refreshed when it is older than pipe_ttl
+ * on open. Output is kept as text and parsed into the model's arenas, so
+ * a reload only has to parse it again.
+ */
+#define PIPE_MAX_OUTPUT (64 * 1024)
+
+struct PipeMenu {
+    char *cmd;
+    char *output;            // Last complete output, or NULL before the first run.
+    int output_len;
+    struct Item *items;      // Parsed output; the submenu of every item running cmd.
+    int nitems, items_cap;
+    struct Model store[2];   // Strings and segments of items, in store[cur], and of the
+    int cur;                 // previous output until pipe_finish has compared them.
+    int parsed;              // items match output and the current model.
+    double fetched_at;       // Monotonic time of the last complete run.
+    pid_t pid;               // Running generator, or 0.
+    int fd;                  // Read end of its stdout, or -1.
+    char *buf;               // Output read so far.
+    int len, cap;
+    double deadline;
+};
+
+static struct PipeMenu *pipes = NULL;
+static int npipes = 0, pipes_cap = 0;
+
+static struct PipeMenu *pipe_menu_for(const char *cmd) {
+    for (int i = 0; i < npipes; i++)
+        if (strcmp(pipes[i].cmd, cmd) == 0)
+            return &pipes[i];
+    pipes = grow(pipes, &pipes_cap, npipes + 1, sizeof(struct PipeMenu));
+    struct PipeMenu *p = &pipes[npipes++];
+    memset(p, 0, sizeof(*p));
+    p->cmd = strdup(cmd);
+    p->fd = -1;
+    return p;
+}
+
+/* Generated entries live in their pipe menu's store, so each new output replaces the last. */
+static struct Model *item_arena(const struct Item *item) {
+    if (!item->store)
+        return &model;
+    return &pipes[(item->store - 1) / 2].store[(item->store - 1) % 2];
+}
+
+/* Empty one of a pipe menu's stores, keeping its memory for the next output. */
+static void pipe_store_clear(struct Model *st) {
+    for (int i = 0; dpy && i < st->nsegments; i++)
+        XftColorFree(dpy, menu_vi.visual, menu_cmap, &st->segments[i].xft_color);
+    st->nsegments = 0;
+    st->strings_len = 0;
+}
+
+/* Turn the output into submenu entries; a placeholder row if there are none. */
+static void pipe_parse(struct PipeMenu *p) {
+    p->nitems = 0;
+    p->cur = !p->cur;
+    int store = (p - pipes) * 2 + p->cur + 1;
+    pipe_store_clear(&p->store[p->cur]);
+    arena = &p->store[p->cur];
+    const char *text = p->output ? p->output : "Loading...";
+    const char *end = text + strlen(text);
+    while (text < end) {
+        const char *nl = memchr(text, '\n', end - text);
+        const char *line = text, *eol = nl ? nl : end;
+        text = nl ? nl + 1 : end;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        const char *s = line;
+        while (s < eol && (*s == ' ' || *s == '\t')) s++;
+        if (s == eol)
+            continue;
+        struct Item item = {0};
+        item.store = store;
+        if (eol - line == 3 && memcmp(line, "___", 3) == 0) {
+            item.separator = 1;
+        } else {
+            const char *delim = memmem(line, eol - line, " = ", 3);
+            const char *label_end = delim ? delim : eol;
+            const char *cmd = delim ? delim + 3 : eol;
+            item.output_len = eol - cmd;
+            item.output = intern(cmd, item.output_len);
+            parse_label(line, label_end - line, &item, NULL);
+        }
+        p->items = grow(p->items, &p->items_cap, p->nitems + 1, sizeof(struct Item));
+        p->items[p->nitems++] = item;
+    }
+    if (p->nitems == 0) {
+        struct Item empty = {0};
+        empty.store = store;
+        empty.output = intern("", 0);
+        parse_label("(empty)", 7, &empty, NULL);
+        p->items = grow(p->items, &p->items_cap, 1, sizeof(struct Item));
+        p->items[p->nitems++] = empty;
+    }
+    arena = &model;
+    p->parsed = 1;
+}
+
+/* Start the generator unless it is already running or its output is still being read. */
+static void pipe_refresh(struct PipeMenu *p) {
+    if (p->pid > 0 || p->fd >= 0)
+        return;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        LOG_WARNING("pipe", "pipe failed for: %s", p->cmd);
+        return;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    // Its own session, so a timeout can kill everything the script started.
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK);
+    char *argv[] = { "/bin/sh", "-c", p->cmd, NULL };
+    int err = posix_spawn(&p->pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err != 0) {
+        LOG_WARNING("pipe", "Cannot run %s: %s", p->cmd, strerror(err));
+        close(fds[0]);
+        p->pid = 0;
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    p->fd = fds[0];
+    p->len = 0;
+    p->deadline = monotonic_now() + config.pipe_timeout;
+    pipe_runs++;
+    LOG_DBG("pipe", "Started pid %d: %s", (int)p->pid, p->cmd);
+}
+
+static int same_item(const struct Item *a, const struct Item *b) {
+    if (a->separator != b->separator || a->nsegments != b->nsegments ||
+        a->output_len != b->output_len || strcmp(ITEM_STR(a, a->output), ITEM_STR(b, b->output)) != 0)
+        return 0;
+    for (int i = 0; i < a->nsegments; i++) {
+        struct LabelSegment *x = ITEM_SEG(a, i), *y = ITEM_SEG(b, i);
+        if (x->xft_color.pixel != y->xft_color.pixel || strcmp(ITEM_STR(a, x->text), ITEM_STR(b, y->text)) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Point every item running p at its new entries. An open submenu of the
+ * same size only repaints the rows that changed; otherwise it is resized
+ * and repainted, and a closed one gives its window back to the pool.
+ */
+static void pipe_update(struct PipeMenu *p, struct Item *old, int nold) {
+    int index = p - pipes + 1;
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *parent = item_at(d, i);
+            if (parent->pipe != index)
+                continue;
+            parent->submenu = p->items;
+            parent->nsubitems = p->nitems;
+            parent->submenu_gen = 0;
+            if (parent == menu_root && levels[0].items == old) {
+                // Shown as the top level by "--show --menu".
+                layout_submenu(parent);
+                levels[0].items = p->items;
+                levels[0].nitems = p->nitems;
+                if (levels[0].selected >= p->nitems)
+                    levels[0].selected = -1;
+                levels[0].top = 0;
+                if (is_menu_mapped()) {
+                    fit_main_window(parent->submenu_width, p->nitems);
+                    draw_level(&levels[0]);
+                    frame_pending = 1;
+                }
+            }
+            if (!parent->popup)
+                continue;
+            struct MenuLevel *l = NULL;
+            for (int k = 1; k < nlevels && !l; k++)
+                if (levels[k].surf == parent->popup)
+                    l = &levels[k];
+            if (!l) {
+                spare_popups = grow(spare_popups, &spare_popups_cap, nspare_popups + 1,
+                                    sizeof(struct Surface *));
+                spare_popups[nspare_popups++] = parent->popup;
+                parent->popup = NULL;
+                continue;
+            }
+            layout_submenu(parent);
+            int width = parent->submenu_width + 2 * config.border_width;
+            int height = capped_rows(p->nitems) * itemheight + 2 * config.border_width;
+            l->items = p->items;
+            l->nitems = p->nitems;
+            if (width == l->surf->width && height == l->surf->height && p->nitems == nold) {
+                for (int r = 0; r < p->nitems; r++)
+                    if (!same_item(&old[r], &p->items[r]))
+                        draw_row(l, r);
+            } else {
+                surface_resize(l->surf, width, height);
+                if (l->selected >= l->nitems)
+                    l->selected = -1;
+                l->top = 0;
+                if (l->y + height > DisplayHeight(dpy, screen)) {
+                    l->y = DisplayHeight(dpy, screen) - height;
+                    XMoveWindow(dpy, l->surf->win, l->x, l->y);
+                }
+                draw_level(l);
+            }
+            frame_pending = 1;
+        }
+    }
+}
+
+/*
+ * The generator finished, or was stopped with error set: adopt its output if
+ * it changed. A failed run keeps the last good output, or shows the error
+ * as the only entry if there is none yet.
+ */
+static void pipe_finish(struct PipeMenu *p, const char *error) {
+    close(p->fd);
+    p->fd = -1;
+    p->pid = 0;
+    if (error && p->output)
+        return;  // Keep showing the last good output.
+    p->fetched_at = monotonic_now();
+    const char *text = error ? error : p->buf;
+    int len = error ? (int)strlen(error) : p->len;
+    if (p->output && p->output_len == len && memcmp(p->output, text, len) == 0) {
+        LOG_DBG("pipe", "Unchanged: %s", p->cmd);
+        return;
+    }
+    char *output = malloc(len + 1);
+    if (!output) {
+        LOG_WARNING("pipe", "Not enough memory for the output of: %s", p->cmd);
+        return;
+    }
+    memcpy(output, text, len);
+    output[len] = '\0';
+    free(p->output);
+    p->output = output;
+    p->output_len = len;
+
+    // Parse into a fresh array so the old rows can be compared for repainting.
+    struct Item *old = p->items;
+    int nold = p->nitems;
+    p->items = NULL;
+    p->items_cap = 0;
+    int nnames = nicon_names;
+    pipe_parse(p);
+    pipe_update(p, old, nold);
+    free(old);
+    pipe_store_clear(&p->store[!p->cur]);
+    if (nicon_names > nnames)
+        icons_load();  // New icon names in the output.
+    LOG("pipe", "%d entries from: %s", p->nitems, p->cmd);
+}
+
+/* Hook the pipe menus up to a freshly loaded model and start any never run. */
+static void pipe_attach(void) {
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (!it->pipe)
+                continue;
+            struct PipeMenu *p = pipe_menu_for(STR(it->output));
+            if (!p->parsed)
+                pipe_parse(p);
+            it->pipe = p - pipes + 1;
+            it->submenu = p->items;
+            it->nsubitems = p->nitems;
+            if (p->fetched_at == 0)
+                pipe_refresh(p);
+        }
+    }
+}
+
+/* Called by open_submenu: refresh in the background once the output is stale. */
+static void pipe_opened(struct Item *parent) {
+    struct PipeMenu *p = &pipes[parent->pipe - 1];
+    if (p->fetched_at > 0 && monotonic_now() - p->fetched_at >= config.pipe_ttl)
+        pipe_refresh(p);
+}
+
+/* Add the running generators to run()'s select set and timeout. */
+static void pipe_select(fd_set *fds, int *maxfd, double *wait) {
+    double now = monotonic_now();
+    for (int i = 0; i < npipes; i++) {
+        if (pipes[i].fd < 0)
+            continue;
+        FD_SET(pipes[i].fd, fds);
+        if (pipes[i].fd > *maxfd)
+            *maxfd = pipes[i].fd;
+        double left = pipes[i].deadline - now;
+        if (left < 0.001)
+            left = 0.001;
+        if (*wait < 0 || left < *wait)
+            *wait = left;
+    }
+}
+
+/* Read whatever the generators wrote and stop those past their timeout. */
+static void pipe_poll(fd_set *fds) {
+    double now = monotonic_now();
+    for (int i = 0; i < npipes; i++) {
+        struct PipeMenu *p = &pipes[i];
+        if (p->fd < 0)
+            continue;
+        if (FD_ISSET(p->fd, fds)) {
+            ssize_t n;
+            int dropped = 0;
+            char chunk[4096];
+            while ((n = read(p->fd, chunk, sizeof(chunk))) > 0) {
+                int keep = p->len + n > PIPE_MAX_OUTPUT ? PIPE_MAX_OUTPUT - p->len : (int)n;
+                dropped |= keep < n;
+                p->buf = grow(p->buf, &p->cap, p->len + keep + 1, 1);
+                memcpy(p->buf + p->len, chunk, keep);
+                p->len += keep;
+            }
+            if (dropped) {
+                LOG_WARNING("pipe", "Output over %d bytes: %s", PIPE_MAX_OUTPUT, p->cmd);
+                if (p->pid > 0)
+                    kill(-p->pid, SIGKILL);
+                pipe_finish(p, "(output too long)");
+                continue;
+            }
+            if (n == 0) {
+                pipe_finish(p, NULL);
+                continue;
+            }
+        }
+        if (now >= p->deadline) {
+            LOG_WARNING("pipe", "Timed out after %.1f s: %s", config.pipe_timeout, p->cmd);
+            if (p->pid > 0)
+                kill(-p->pid, SIGKILL);
+            pipe_timeouts++;
+            pipe_finish(p, "(timed out)");
+        }
+    }
+}
+
+/* On reload the arenas are rebuilt, so the entries must be parsed again. */
+static void pipe_detach(void) {
+    for (int i = 0; i < npipes; i++) {
+        pipes[i].parsed = 0;
+        pipes[i].nitems = 0;
+    }
+}
+
+static void free_pipes(void) {
+    for (int i = 0; i < npipes; i++) {
+        if (pipes[i].pid > 0)
+            kill(-pipes[i].pid, SIGKILL);
+        if (pipes[i].fd >= 0)
+            close(pipes[i].fd);
+        free(pipes[i].cmd);
+        free(pipes[i].output);
+        free(pipes[i].items);
+        free(pipes[i].buf);
+        for (int k = 0; k < 2; k++) {
+            pipe_store_clear(&pipes[i].store[k]);
+            free(pipes[i].store[k].strings);
+            free(pipes[i].store[k].segments);
+        }
+    }
+    free(pipes);
+    pipes = NULL;
+    npipes = pipes_cap = 0;
+}
+
+/*
+ * Icons. "<icon='name'>" in a label names a theme icon or a PNG file. Names
+ * are registered while parsing; a worker thread resolves and decodes them,
+ * scales each to icon_size and packs them into one premultiplied ARGB image
+ * that the main thread uploads once as the atlas Picture, so a row's icon is
+ * a single XRenderComposite. The packed image is kept in the cache directory
+ * and reused while every source file has the same mtime. The worker must not
+ * LOG; it hands back its IconJob and writes to wake_pipe.
+ */
+#define ICON_CACHE_MAGIC 0x49434d47  // "GMCI"
+#define ICON_CACHE_VERSION 1
+#define ICON_MAX_PIXELS (4096 * 4096)  // Larger source images are skipped.
+
+struct IconCacheHeader {
+    uint32_t magic, version;
+    uint32_t size, count, cols, found;
+    uint64_t key;    // fnv1a of the theme and each name, resolved path and mtime.
+};
+
+struct IconJob {
+    const char **names;  // Borrowed from icon_names, which only grows.
+    int n, size, cols;
+    char theme[64];
+    char cache_file[PATH_MAX + 32];
+    uint32_t *pixels;    // cols * size pixels wide, a size-square cell per icon.
+    int found, from_cache;
+    double started;
+};
+
+static int *icon_table = NULL;   // Open addressing over icon_names: index + 1, 0 when empty.
+static int icon_table_cap = 0;
+static Picture icon_atlas = None;
+static int atlas_count = 0, atlas_cols = 1, atlas_size = 0;
+static char atlas_theme[64];
+static struct IconJob *icon_job = NULL;  // Running job, owned by the worker until icon_job_done.
+static pthread_t icon_thread;
+static int icon_job_done = 0;
+
+static uint64_t icon_hash(const char *name) {
+    return fnv1a(0xcbf29ce484222325ULL, name, strlen(name));
+}
+
+/* Return the atlas slot for a name, adding it if it is new. Slots never move. */
+static int icon_register(const char *name) {
+    if (2 * (nicon_names + 1) > icon_table_cap) {
+        int cap = icon_table_cap ? icon_table_cap * 2 : 64;
+        int *table = calloc(cap, sizeof(int));
+        if (!table) {
+            fprintf(stderr, "gmenu: Memory allocation failed for icons\n");
+            exit(1);
+        }
+        for (int i = 0; i < nicon_names; i++) {
+            int j = icon_hash(icon_names[i]) & (cap - 1);
+            while (table[j])
+                j = (j + 1) & (cap - 1);
+            table[j] = i + 1;
+        }
+        free(icon_table);
+        icon_table = table;
+        icon_table_cap = cap;
+    }
+    int j = icon_hash(name) & (icon_table_cap - 1);
+    for (; icon_table[j]; j = (j + 1) & (icon_table_cap - 1))
+        if (strcmp(icon_names[icon_table[j] - 1], name) == 0)
+            return icon_table[j] - 1;
+    icon_names = grow(icon_names, &icon_names_cap, nicon_names + 1, sizeof(char *));
+    icon_names[nicon_names] = strdup(name);
+    icon_table[j] = nicon_names + 1;
+    return nicon_names++;
+}
+
+/* Items loaded from the menu cache carry the name but a stale slot. */
+static void icons_attach(void) {
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (it->icon)
+                it->icon_slot = icon_register(STR(it->icon - 1)) + 1;
+        }
+    }
+}
+
+/*
+ * Find the file for an icon name: a path is taken as is, anything else is
+ * looked up in the configured theme, then hicolor, preferring the smallest
+ * size at least as large as wanted, and finally in /usr/share/pixmaps.
+ * Only PNG files are considered. Runs on the worker thread.
+ */
+static int icon_resolve(const char *name, const char *theme, int size, char *out) {
+    const char *home = getenv("HOME");
+    if (strchr(name, '/')) {
+        if (name[0] == '~' && name[1] == '/' && home)
+            snprintf(out, PATH_MAX, "%s%s", home, name + 1);
+        else
+            snprintf(out, PATH_MAX, "%s", name);
+        return access(out, R_OK) == 0;
+    }
+
+    // Theme directories that exist, most specific first.
+    char dirs[32][PATH_MAX];
+    int ndirs = 0;
+    char bases[16][PATH_MAX];
+    int nbases = 0;
+    const char *data_home = getenv("XDG_DATA_HOME");
+    if (data_home && *data_home)
+        snprintf(bases[nbases++], PATH_MAX, "%s/icons", data_home);
+    else if (home)
+        snprintf(bases[nbases++], PATH_MAX, "%s/.local/share/icons", home);
+    if (home)
+        snprintf(bases[nbases++], PATH_MAX, "%s/.icons", home);
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+    char list[PATH_MAX];
+    snprintf(list, sizeof(list), "%s", data_dirs && *data_dirs ? data_dirs : "/usr/local/share:/usr/share");
+    char *save;
+    for (char *d = strtok_r(list, ":", &save); d && nbases < 16; d = strtok_r(NULL, ":", &save))
+        snprintf(bases[nbases++], PATH_MAX, "%s/icons", d);
+    const char *themes[] = { theme, "hicolor" };
+    int nthemes = strcmp(theme, "hicolor") == 0 ? 1 : 2;
+    for (int t = 0; t < nthemes; t++)
+        for (int b = 0; b < nbases && ndirs < 32; b++) {
+            struct stat st;
+            if (snprintf(dirs[ndirs], PATH_MAX, "%s/%s", bases[b], themes[t]) < PATH_MAX &&
+                stat(dirs[ndirs], &st) == 0 && S_ISDIR(st.st_mode))
+                ndirs++;
+        }
+
+    static const int sizes[] = { 16, 22, 24, 32, 48, 64, 96, 128, 256, 512 };
+    static const char *contexts[] = { "apps", "places", "devices", "categories",
+                                      "actions", "status", "mimetypes", "emblems" };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int order[sizeof(sizes) / sizeof(sizes[0])], norder = 0;
+    for (int i = 0; i < nsizes; i++)
+        if (sizes[i] >= size)
+            order[norder++] = sizes[i];
+    for (int i = nsizes - 1; i >= 0; i--)
+        if (sizes[i] < size)
+            order[norder++] = sizes[i];
+    for (int d = 0; d < ndirs; d++)
+        for (int s = 0; s < norder; s++)
+            for (size_t c = 0; c < sizeof(contexts) / sizeof(contexts[0]); c++) {
+                if (snprintf(out, PATH_MAX, "%s/%dx%d/%s/%s.png", dirs[d], order[s], order[s],
+                             contexts[c], name) < PATH_MAX && access(out, R_OK) == 0)
+                    return 1;
+            }
+    snprintf(out, PATH_MAX, "/usr/share/pixmaps/%s.png", name);
+    return access(out, R_OK) == 0;
+}
+
+/*
+ * Decode a PNG and box-filter it into a size-square cell of dst, keeping the
+ * aspect ratio and centring it. Output is premultiplied, as Render expects.
+ */
+static int icon_decode(const char *path, int size, uint32_t *dst, int stride) {
+    png_image img;
+    memset(&img, 0, sizeof(img));
+    img.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&img, path))
+        return 0;
+    if ((uint64_t)img.width * img.height > ICON_MAX_PIXELS) {
+        png_image_free(&img);
+        return 0;
+    }
+    // One 32-bit word per pixel, 0xAARRGGBB in host byte order.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    img.format = PNG_FORMAT_BGRA;
+#else
+    img.format = PNG_FORMAT_ARGB;
+#endif
+    uint32_t *src = malloc(PNG_IMAGE_SIZE(img));
+    if (!src || !png_image_finish_read(&img, NULL, src, 0, NULL)) {
+        png_image_free(&img);
+        free(src);
+        return 0;
+    }
+
+    int w = img.width, h = img.height;
+    int dw = w >= h ? size : (int)((double)w * size / h + 0.5);
+    int dh = h >= w ? size : (int)((double)h * size / w + 0.5);
+    if (dw < 1) dw = 1;
+    if (dh < 1) dh = 1;
+    uint32_t *cell = dst + (size - dh) / 2 * stride + (size - dw) / 2;
+    for (int y = 0; y < dh; y++) {
+        int y0 = (int64_t)y * h / dh, y1 = (int64_t)(y + 1) * h / dh;
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int x = 0; x < dw; x++) {
+            int x0 = (int64_t)x * w / dw, x1 = (int64_t)(x + 1) * w / dw;
+            if (x1 <= x0) x1 = x0 + 1;
+            uint64_t a = 0, r = 0, g = 0, b = 0;
+            for (int sy = y0; sy < y1; sy++)
+                for (int sx = x0; sx < x1; sx++) {
+                    uint32_t px = src[sy * w + sx];
+                    uint32_t pa = px >> 24;
+                    a += pa;
+                    r += (px >> 16 & 0xFF) * pa;
+                    g += (px >> 8 & 0xFF) * pa;
+                    b += (px & 0xFF) * pa;
+                }
+            uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+            cell[y * stride + x] = (uint32_t)(a / n) << 24 | (uint32_t)(r / (255 * n)) << 16 |
+                                   (uint32_t)(g / (255 * n)) << 8 | (uint32_t)(b / (255 * n));
+        }
+    }
+    free(src);
+    return 1;
+}
+
+static int icon_cache_read(struct IconJob *job, uint64_t key, size_t pixels_size) {
+    FILE *fp = fopen(job->cache_file, "rbe");
+    if (!fp)
+        return 0;
+    struct IconCacheHeader hdr;
+    int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             hdr.magic == ICON_CACHE_MAGIC && hdr.version == ICON_CACHE_VERSION &&
+             hdr.size == (uint32_t)job->size && hdr.count == (uint32_t)job->n &&
+             hdr.cols == (uint32_t)job->cols && hdr.key == key &&
+             fread(job->pixels, 1, pixels_size, fp) == pixels_size;
+    fclose(fp);
+    if (ok)
+        job->found = hdr.found;
+    return ok;
+}
+
+static void *icon_worker(void *arg) {
+    struct IconJob *job = arg;
+    int size = job->size, stride = job->cols * size;
+    int rows = (job->n + job->cols - 1) / job->cols;
+    size_t pixels_size = (size_t)stride * rows * size * sizeof(uint32_t);
+    char **paths = calloc(job->n, sizeof(char *));  // NULL where the icon was not found.
+    char *image = calloc(1, sizeof(struct IconCacheHeader) + pixels_size);
+    if (paths && image) {
+        job->pixels = (uint32_t *)(image + sizeof(struct IconCacheHeader));
+        uint64_t key = fnv1a(0xcbf29ce484222325ULL, job->theme, strlen(job->theme) + 1);
+        for (int i = 0; i < job->n; i++) {
+            char path[PATH_MAX];
+            struct stat st;
+            if (icon_resolve(job->names[i], job->theme, size, path) && stat(path, &st) == 0)
+                paths[i] = strdup(path);
+            else
+                memset(&st, 0, sizeof(st));
+            int64_t mtime[] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+            key = fnv1a(key, job->names[i], strlen(job->names[i]) + 1);
+            if (paths[i])
+                key = fnv1a(key, paths[i], strlen(paths[i]) + 1);
+            key = fnv1a(key, mtime, sizeof(mtime));
+        }
+        job->from_cache = icon_cache_read(job, key, pixels_size);
+        if (!job->from_cache) {
+            for (int i = 0; i < job->n; i++) {
+                uint32_t *cell = job->pixels + (size_t)(i / job->cols) * size * stride + i % job->cols * size;
+                if (paths[i] && icon_decode(paths[i], size, cell, stride))
+                    job->found++;
+            }
+            struct IconCacheHeader hdr = {
+                ICON_CACHE_MAGIC, ICON_CACHE_VERSION, size, job->n, job->cols, job->found, key
+            };
+            memcpy(image, &hdr, sizeof(hdr));
+            write_atomically(job->cache_file, image, sizeof(hdr) + pixels_size);
+        }
+    } else {
+        free(image);
+    }
+    for (int i = 0; paths && i < job->n; i++)
+        free(paths[i]);
+    free(paths);
+    __atomic_store_n(&icon_job_done, 1, __ATOMIC_RELEASE);
+    if (write(wake_pipe[1], "", 1) < 0) {
+        // The pipe is full, so run() is due to wake up anyway.
+    }
+    return NULL;
+}
+
+/* Start building the atlas unless it already holds every registered name. */
+static void icons_load(void) {
+    if (icon_job || nicon_names == 0)
+        return;  // icons_poll calls back once the running job is adopted.
+    if (nicon_names == atlas_count && icon_size == atlas_size &&
+        strcmp(config.icon_theme, atlas_theme) == 0)
+        return;
+    struct IconJob *job = calloc(1, sizeof(*job));
+    if (job)
+        job->names = malloc(nicon_names * sizeof(char *));
+    if (!job || !job->names) {
+        fprintf(stderr, "gmenu: Memory allocation failed for icons\n");
+        exit(1);
+    }
+    memcpy(job->names, icon_names, nicon_names * sizeof(char *));
+    job->n = nicon_names;
+    job->size = icon_size;
+    job->cols = (int)ceil(sqrt(nicon_names));
+    snprintf(job->theme, sizeof(job->theme), "%s", config.icon_theme);
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    char dir[PATH_MAX];
+    if (cache_home && *cache_home)
+        snprintf(dir, sizeof(dir), "%s/gmenu", cache_home);
+    else
+        snprintf(dir, sizeof(dir), "%s/.cache/gmenu", getenv("HOME"));
+    mkdir(dir, 0755);
+    snprintf(job->cache_file, sizeof(job->cache_file), "%s/icons.atlas", dir);
+    job->started = monotonic_now();
+    __atomic_store_n(&icon_job_done, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&icon_thread, NULL, icon_worker, job) != 0) {
+        LOG_WARNING("icons", "Cannot start the icon loader");
+        free(job->names);
+        free(job);
+        return;
+    }
+    icon_job = job;
+}
+
+/* Upload a finished atlas. Waits while the menu is shown so rows never change under the pointer. */
+static void icons_poll(void) {
+    if (!icon_job || is_menu_mapped() || !__atomic_load_n(&icon_job_done, __ATOMIC_ACQUIRE))
+        return;
+    pthread_join(icon_thread, NULL);
+    struct IconJob *job = icon_job;
+    icon_job = NULL;
+    char *image = job->pixels ? (char *)job->pixels - sizeof(struct IconCacheHeader) : NULL;
+    if (icon_atlas) {
+        XRenderFreePicture(dpy, icon_atlas);
+        icon_atlas = None;
+    }
+    atlas_count = 0;
+    if (image) {
+        int width = job->cols * job->size, height = (job->n + job->cols - 1) / job->cols * job->size;
+        Pixmap pixmap = XCreatePixmap(dpy, root, width, height, 32);
+        GC pgc = XCreateGC(dpy, pixmap, 0, NULL);
+        XImage *img = XCreateImage(dpy, menu_vi.visual, 32, ZPixmap, 0, (char *)job->pixels,
+                                   width, height, 32, 0);
+        uint32_t one = 1;
+        img->byte_order = *(char *)&one ? LSBFirst : MSBFirst;  // Xlib swaps for the server if needed.
+        XPutImage(dpy, pixmap, pgc, img, 0, 0, 0, 0, width, height);
+        img->data = NULL;  // Freed with image below.
+        XDestroyImage(img);
+        XFreeGC(dpy, pgc);
+        icon_atlas = XRenderCreatePicture(dpy, pixmap, menu_fmt, 0, NULL);
+        XFreePixmap(dpy, pixmap);
+        atlas_count = job->n;
+        atlas_cols = job->cols;
+        atlas_size = job->size;
+        snprintf(atlas_theme, sizeof(atlas_theme), "%s", job->theme);
+        icons_found = job->found;
+        icons_missing = job->n - job->found;
+        LOG("icons", "%d of %d icons at %dpx %s in %.1f ms", job->found, job->n, job->size,
+            job->from_cache ? "from cache" : "decoded", (monotonic_now() - job->started) * 1000);
+    } else {
+        LOG_WARNING("icons", "Not enough memory for a %d-icon atlas", job->n);
+    }
+    free(image);
+    free(job->names);
+    free(job);
+    repaint_icon_popups();
+    icons_load();  // Names registered while the worker ran.
+}
 
-        // Separator line
-        if (strcmp(line, "___") == 0) {
-            struct Item sep_item = {0};
-            sep_item.separator = 1;
-            items[nitems++] = sep_item;
-            current_parent = NULL;
-            continue;
+/* Pooled popups with icon rows were painted without the new atlas. */
+static void repaint_icon_popups(void) {
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (!it->popup)
+                continue;
+            for (int k = 0; k < it->nsubitems; k++) {
+                if (it->submenu[k].icon_slot) {
+                    prepaint_popup(it);
+                    break;
+                }
+            }
         }
+    }
+}
+
+static void free_icons(void) {
+    if (icon_job) {
+        pthread_join(icon_thread, NULL);
+        if (icon_job->pixels)
+            free((char *)icon_job->pixels - sizeof(struct IconCacheHeader));
+        free(icon_job->names);
+        free(icon_job);
+        icon_job = NULL;
+    }
+    if (icon_atlas)
+        XRenderFreePicture(dpy, icon_atlas);
+    for (int i = 0; i < nicon_names; i++)
+        free(icon_names[i]);
+    free(icon_names);
+    free(icon_table);
+    icon_names = NULL;
+    icon_table = NULL;
+    nicon_names = icon_names_cap = icon_table_cap = 0;
+}
 
-        // Submenu lines start with "=="
-        int is_submenu = (strncmp(line, "==", 2) == 0);
-        char *text = is_submenu ? line + 2 : line;
-        while (*text && isspace(*text)) text++;
+/* Append [start, end) to the item as one segment drawn with the given font. */
+static void add_run(struct Item *item, const char *start, const char *end, unsigned long color,
+                    int font, int joined) {
+    arena->segments = grow(arena->segments, &arena->segments_cap,
+                           arena->nsegments + 1, sizeof(struct LabelSegment));
+    struct LabelSegment *seg = &arena->segments[arena->nsegments];
+    seg->len = end - start;
+    seg->text = intern(start, seg->len);
+    seg->x = 0;
+    seg->font = font;
+    seg->joined = joined;
+    XRenderColor c = render_color(color, 1.0);
+    if (dpy)  // The parse-only builds have no display.
+        XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &c, &seg->xft_color);
+    if (item->nsegments == 0)
+        item->seg_first = arena->nsegments;
+    arena->nsegments++;
+    item->nsegments++;
+}
 
-        // We expect "label = command"
-        char *delim = strstr(text, " = ");
-        char label_buf[MAX_LABEL];
-        char output_buf[MAX_LABEL];
-        if (delim) {
-            int labellen = delim - text;
-            if (labellen >= MAX_LABEL) {
-                labellen = MAX_LABEL - 1;
-            }
-            strncpy(label_buf, text, labellen);
-            label_buf[labellen] = '\0';
+/*
+ * Trim [start, end) and append it to the item in the given color, split into
+ * runs of characters that share a font. Spaces stay in the run they follow.
+ */
+static void add_segment(struct Item *item, const char *start, const char *end, unsigned long color) {
+    while (start < end && isspace((unsigned char)*start)) start++;
+    while (end > start && isspace((unsigned char)end[-1])) end--;
 
-            strncpy(output_buf, delim + 3, MAX_LABEL - 1);
-            output_buf[MAX_LABEL - 1] = '\0';
+    const char *run = start;
+    int run_font = -1, joined = 0;
+    for (const char *p = start; p < end; ) {
+        FcChar32 c;
+        int n = FcUtf8ToUcs4((const FcChar8 *)p, &c, end - p);
+        int f;
+        if (n <= 0) {
+            n = 1;  // Invalid UTF-8: leave it to the primary font.
+            f = 0;
         } else {
-            strncpy(label_buf, text, MAX_LABEL - 1);
-            label_buf[MAX_LABEL - 1] = '\0';
-            output_buf[0] = '\0';
+            f = c == ' ' && run_font >= 0 ? run_font : font_for(c);
         }
-
-        struct Item item = {0};
-        item.separator = 0;
-        parse_label(label_buf, item.segments, &item.nsegments);
-        if (item.nsegments == 0) {
-            // no color segments, store plain label
-            strncpy(item.label, label_buf, MAX_LABEL - 1);
-        }
-        strncpy(item.output, output_buf, MAX_LABEL - 1);
-
-        if (!is_submenu) {
-            // top-level item
-            items[nitems++] = item;
-            current_parent = &items[nitems - 1];
-        } else if (current_parent) {
-            // Expand parent's submenu array
-            struct Item *new_submenu = realloc(current_parent->submenu,
-                                               (current_parent->nsubitems + 1) * sizeof(struct Item));
-            if (!new_submenu) {
-                fprintf(stderr, "gmenu: Memory allocation failed for submenu\n");
-                fclose(fp);
-                cleanup();
-                exit(1);
-            }
-            current_parent->submenu = new_submenu;
-            current_parent->submenu[current_parent->nsubitems++] = item;
+        if (run_font >= 0 && f != run_font) {
+            add_run(item, run, p, color, run_font, joined);
+            joined = 1;
+            run = p;
         }
+        run_font = f;
+        p += n;
     }
+    add_run(item, run, end, color, run_font >= 0 ? run_font : 0, joined);
+}
 
-    fclose(fp);
+/* Read "#rrggbb" (the '#' is optional) from [p, end). */
+static int parse_hex_color(const char *p, const char *end, unsigned long *color) {
+    if (p < end && *p == '#')
+        p++;
+    if (end - p != 6)
+        return 0;
+    unsigned long v = 0;
+    for (; p < end; p++) {
+        int c = (unsigned char)*p;
+        if (!isxdigit(c))
+            return 0;
+        v = v << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    *color = v;
+    return 1;
 }
 
-static void parse_label(const char *input, struct LabelSegment segments[], int *nsegments) {
-    *nsegments = 0;
-    while (*input && isspace(*input)) {
-        input++;
+/* Append [start, end) in the given color unless it is only whitespace. */
+static void flush_text(struct Item *item, const char *start, const char *end, unsigned long color) {
+    for (const char *p = start; p < end; p++) {
+        if (!isspace((unsigned char)*p)) {
+            add_segment(item, start, end, color);
+            return;
+        }
     }
-    const char *p = input;
+}
 
-    while (*p && *nsegments < MAX_SEGMENTS) {
-        if (strncmp(p, "<color='", 8) == 0) {
-            // e.g. <color='#0078D7'> ... </color>
-            p += 8;  // Skip "<color='"
-            char color_code[8] = {0};
-            int i = 0;
-            while (*p && *p != '\'' && i < 7) {
-                color_code[i++] = *p++;
-            }
-            color_code[i] = '\0';
-            if (color_code[0] == '#') {
-                memmove(color_code, color_code + 1, strlen(color_code));
-            }
-            if (*p == '\'') p++;  // skip closing quote
-            if (*p == '>') p++;   // skip '>'
-            unsigned long color = strtoul(color_code, NULL, 16);
-
-            // find the matching </color>
-            const char *end = strstr(p, "</color>");
-            if (end) {
-                int len = end - p;
-                if (len >= MAX_LABEL) {
-                    len = MAX_LABEL - 1;
-                }
-                strncpy(segments[*nsegments].text, p, len);
-                segments[*nsegments].text[len] = '\0';
-
-                // trim whitespace
-                // quick trim function inline
-                char *seg_str = segments[*nsegments].text;
-                while (*seg_str && isspace(*seg_str)) seg_str++;
-                memmove(segments[*nsegments].text, seg_str, strlen(seg_str)+1);
-                // trailing
-                char *endtrim = segments[*nsegments].text + strlen(segments[*nsegments].text) - 1;
-                while (endtrim > segments[*nsegments].text && isspace(*endtrim)) {
-                    *endtrim-- = '\0';
-                }
+/*
+ * Parse the markup of one label in a single pass over [text, text + len).
+ * <color> tags nest; a tag that cannot be parsed is reported through ps
+ * (which may be NULL) and kept as literal text.
+ */
+static void parse_label(const char *text, size_t len, struct Item *item, struct ParseState *ps) {
+    item->nsegments = 0;
+    item->icon = 0;
+    item->icon_slot = 0;
+    const char *end = text + len, *run = text, *p = text;
+    unsigned long color = config.fg;
+    unsigned long outer[MAX_COLOR_DEPTH];  // The colors the open tags replaced.
+    const char *opened = NULL;             // The innermost open tag, for errors.
+    int depth = 0;
 
-                segments[*nsegments].color = color;
-                (*nsegments)++;
-                p = end + 8;  // skip "</color>"
-            } else {
-                break;
+    while (p < end) {
+        const char *lt = memchr(p, '<', end - p);
+        if (!lt)
+            break;
+        size_t rest = end - lt;
+        p = lt + 1;
+        if (rest >= 8 && memcmp(lt, "<color='", 8) == 0) {
+            // e.g. <color='#0078D7'> ... </color>
+            const char *value = lt + 8;
+            const char *quote = memchr(value, '\'', end - value);
+            unsigned long c;
+            if (!quote || quote + 1 == end || quote[1] != '>') {
+                parse_error(ps, lt, "unterminated <color> tag");
+                continue;
             }
-        } else {
-            // plain text until next <color= or end
-            const char *start = p;
-            while (*p && strncmp(p, "<color='", 8) != 0) {
-                p++;
+            if (depth == MAX_COLOR_DEPTH) {
+                parse_error(ps, lt, "<color> tags nested deeper than %d", MAX_COLOR_DEPTH);
+                continue;
             }
-            int len = p - start;
-            if (len >= MAX_LABEL) {
-                len = MAX_LABEL - 1;
+            if (!parse_hex_color(value, quote, &c)) {
+                parse_error(ps, value, "bad color '%.*s', expected #rrggbb", (int)(quote - value), value);
+                c = config.fg;
             }
-            strncpy(segments[*nsegments].text, start, len);
-            segments[*nsegments].text[len] = '\0';
-
-            // trim whitespace
-            char *seg_str = segments[*nsegments].text;
-            while (*seg_str && isspace(*seg_str)) seg_str++;
-            memmove(segments[*nsegments].text, seg_str, strlen(seg_str)+1);
-            char *endtrim = segments[*nsegments].text + strlen(segments[*nsegments].text) - 1;
-            while (endtrim > segments[*nsegments].text && isspace(*endtrim)) {
-                *endtrim-- = '\0';
+            flush_text(item, run, lt, color);
+            outer[depth++] = color;
+            color = c;
+            opened = lt;
+            run = p = quote + 2;
+        } else if (rest >= 8 && memcmp(lt, "</color>", 8) == 0) {
+            flush_text(item, run, lt, color);
+            if (depth > 0)
+                color = outer[--depth];
+            else
+                parse_error(ps, lt, "</color> without <color>");
+            run = p = lt + 8;
+        } else if (rest >= 7 && memcmp(lt, "<icon='", 7) == 0) {
+            // e.g. <icon='firefox'> or <icon='~/icons/mail.png'>; the first one counts
+            const char *name = lt + 7;
+            const char *quote = memchr(name, '\'', end - name);
+            if (!quote) {
+                parse_error(ps, lt, "unterminated <icon> tag");
+                continue;
             }
-
-            segments[*nsegments].color = config.fg;
-            (*nsegments)++;
+            if (quote > name && !item->icon) {
+                item->icon = intern(name, quote - name) + 1;
+                item->icon_slot = icon_register(ITEM_STR(item, item->icon - 1)) + 1;
+            }
+            flush_text(item, run, lt, color);
+            p = quote + 1;
+            if (p < end && *p == '>')
+                p++;
+            run = p;
         }
     }
+    flush_text(item, run, end, color);
+    if (depth > 0)
+        parse_error(ps, opened, "<color> not closed");
 }
 
 static int calculate_submenu_width(struct Item *parent) {
     int submenu_width = 150; // Minimum width
     for (int i = 0; i < parent->nsubitems; i++) {
         // measure the full text (including segments)
-        int textw = item_text_width(&parent->submenu[i]);
+        int textw = parent->submenu[i].width;
+        if (parent->submenu[i].nsubitems > 0)
+            textw += 20; // space for the arrow
         // Add padding/indent, etc.
         int width = textw
                     + 20  // arbitrary extra space
@@ -418,17 +4120,17 @@ static int calculate_submenu_width(struct Item *parent) {
 
 static void calculate_menu_width(void) {
     if (!xft_font) {
-        LOG("Error: Font not loaded in calculate_menu_width");
+        LOG_ERR("menu", "Font not loaded in calculate_menu_width");
         fprintf(stderr, "gmenu: Font not loaded\n");
         exit(1);
     }
     max_menuwidth = 150;
-    for (int i = 0; i < nitems; i++) {
+    for (int i = 0; i < model.nitems; i++) {
         // measure top-level item text (including color segments)
-        int textw = item_text_width(&items[i]);
+        int textw = model.items[i].width;
         // If item has a submenu, maybe add some extra space for the arrow
         // But we already do that in the draw function. Let's just be safe:
-        if (items[i].nsubitems > 0) {
+        if (model.items[i].nsubitems > 0) {
             textw += 20; // space for the arrow
         }
         // add left/right padding
@@ -444,262 +4146,690 @@ static void calculate_menu_width(void) {
         // also consider the subitems, if you want to ensure the main menu can accommodate them
         // but typically the submenu has its own window. We'll skip that here.
     }
-    LOG("Calculated max_menuwidth: %d", max_menuwidth);
+    LOG_DBG("menu", "Calculated max_menuwidth: %d", max_menuwidth);
 }
 
-static void create_submenu_window(struct Item *parent, int x, int y) {
-    destroy_submenu_window();
-    XSetWindowAttributes wa;
-    int submenu_width = calculate_submenu_width(parent) + 2 * config.border_width;
-    int submenu_height = parent->nsubitems * itemheight + 2 * config.border_width;
+/* Return the pooled window for parent, creating and painting it on first use. */
+static struct Surface *submenu_surface(struct Item *parent) {
+    if (parent->popup)
+        return parent->popup;
+
+    int submenu_width = parent->submenu_width + 2 * config.border_width;
+    int submenu_height = capped_rows(parent->nsubitems) * itemheight + 2 * config.border_width;
+    if (nspare_popups > 0) {
+        // Reuse a window left over from before a reload.
+        parent->popup = spare_popups[--nspare_popups];
+        XSetWindowBorderWidth(dpy, parent->popup->win, config.border_width);
+        XSetWindowBorder(dpy, parent->popup->win, config.border_color);
+        surface_resize(parent->popup, submenu_width, submenu_height);
+    } else {
+        XSetWindowAttributes wa;
+        wa.colormap = menu_cmap;
+        wa.background_pixmap = None;
+        wa.background_pixel = config.bg;
+        wa.border_pixel = config.border_color;
+        wa.event_mask = ExposureMask | ButtonPressMask | PointerMotionMask | LeaveWindowMask;
+        wa.override_redirect = True;
+        Window w = XCreateWindow(dpy, root, 0, 0, submenu_width, submenu_height,
+                                 config.border_width, menu_vi.depth, InputOutput, menu_vi.visual,
+                                 CWColormap | CWBorderPixel | CWBackPixel | CWEventMask | CWOverrideRedirect, &wa);
+        parent->popup = calloc(1, sizeof(struct Surface));
+        if (!parent->popup) {
+            fprintf(stderr, "gmenu: Memory allocation failed for submenu window\n");
+            exit(1);
+        }
+        surface_init(parent->popup, w, submenu_width, submenu_height);
+    }
+
+    prepaint_popup(parent);
+    LOG_DBG("x", "Created submenu window with size %dx%d", submenu_width, submenu_height);
+    return parent->popup;
+}
+
+/* Paint the unselected frame of a pooled popup now so showing it is just a map. */
+static void prepaint_popup(struct Item *parent) {
+    struct MenuLevel unshown = { parent->submenu, parent->nsubitems, parent->popup, -1, 0, 0 };
+    draw_level(&unshown);
+    discard_damage(parent->popup);
+}
+
+/* Detach every pooled window from its item and keep it for reuse. */
+static void release_submenu_windows(void) {
+    close_levels(1);
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (!it->popup)
+                continue;
+            spare_popups = grow(spare_popups, &spare_popups_cap, nspare_popups + 1,
+                                sizeof(struct Surface *));
+            spare_popups[nspare_popups++] = it->popup;
+            it->popup = NULL;
+        }
+    }
+}
+
+static void free_submenu_windows(void) {
+    release_submenu_windows();
+    for (int i = 0; i < nspare_popups; i++) {
+        Window w = spare_popups[i]->win;
+        surface_free(spare_popups[i]);
+        XDestroyWindow(dpy, w);
+        free(spare_popups[i]);
+    }
+    free(spare_popups);
+    spare_popups = NULL;
+    nspare_popups = spare_popups_cap = 0;
+}
+
+/* Full repaint of the main menu; hover changes go through select_row instead. */
+static void drawmenu(void) {
+    close_levels(1);
+    draw_level(&levels[0]);
+    present(&main_surf);
+    XFlush(dpy);
+}
+
+/* Paint the visible rows of a level into its back buffer. */
+static void draw_level(struct MenuLevel *l) {
+    paint_fill(l->surf, &palette.bg, 0, 0, l->surf->width, l->surf->height);
+    damage(l->surf, 0, 0, l->surf->width, l->surf->height);
+
+    // All backgrounds first, so the software renderer uploads the frame at once.
+    int end = l->top + visible_rows(l), width = l->surf->width - 2 * config.border_width;
+    for (int i = l->top; i < end; i++)
+        draw_item_background(l->surf, config.border_width, config.border_width + (i - l->top) * itemheight,
+                             width, &l->items[i], i == l->selected);
+    raster_flush(l->surf);
+    for (int i = l->top; i < end; i++) {
+        draw_item_text(l->surf, config.border_width, config.border_width + (i - l->top) * itemheight,
+                       width, &l->items[i], i == l->selected);
+        rows_repainted++;
+    }
+}
+
+static void draw_row(struct MenuLevel *l, int i) {
+    if (i < l->top || i >= l->top + visible_rows(l))
+        return;  // Scrolled out of the window.
+    draw_item(l->surf, config.border_width, config.border_width + (i - l->top) * itemheight,
+              l->surf->width - 2 * config.border_width,
+              &l->items[i], i == l->selected);
+    rows_repainted++;
+}
+
+/* Rows a window may show: as many as fit on the screen. */
+static int capped_rows(int n) {
+    int max_rows = (DisplayHeight(dpy, screen) - 2 * config.border_width - 4) / itemheight;
+    if (max_rows < 1)
+        max_rows = 1;
+    return n < max_rows ? n : max_rows;
+}
+
+/* Rows of the level that fit in its window. */
+static int visible_rows(struct MenuLevel *l) {
+    int rows = (l->surf->height - 2 * config.border_width) / itemheight;
+    return rows < l->nitems ? rows : l->nitems;
+}
+
+/* Move the viewport so row is inside it; returns whether it moved. */
+static int scroll_into_view(struct MenuLevel *l, int row) {
+    int rows = visible_rows(l), top = l->top;
+    if (row < top)
+        top = row;
+    else if (row >= top + rows)
+        top = row - rows + 1;
+    if (top == l->top)
+        return 0;
+    l->top = top;
+    return 1;
+}
+
+/* Scroll a level by delta rows and repaint what is now visible. */
+static void scroll_level(int depth, int delta) {
+    struct MenuLevel *l = &levels[depth];
+    int top = l->top + delta, max_top = l->nitems - visible_rows(l);
+    if (top > max_top)
+        top = max_top;
+    if (top < 0)
+        top = 0;
+    if (top == l->top)
+        return;
+    close_levels(depth + 1);
+    l->top = top;
+    draw_level(l);
+    frame_pending = 1;
+}
+
+/* Start or stop edge scrolling for the row the pointer is on. */
+static void update_autoscroll(int depth, int row) {
+    struct MenuLevel *l = &levels[depth];
+    int step = 0;
+    if (row == l->top && l->top > 0)
+        step = -1;
+    else if (row == l->top + visible_rows(l) - 1 && row < l->nitems - 1)
+        step = 1;
+    if (!step) {
+        autoscroll_depth = -1;
+        return;
+    }
+    if (autoscroll_depth != depth || autoscroll_step != step)
+        autoscroll_deadline = monotonic_now() + SCROLL_INTERVAL;
+    autoscroll_depth = depth;
+    autoscroll_step = step;
+}
+
+static void discard_damage(struct Surface *s) {
+    s->dmg_x0 = s->dmg_y0 = s->dmg_x1 = s->dmg_y1 = 0;
+}
+
+static struct MenuLevel *level_of(Window w) {
+    for (int i = 0; i < nlevels; i++) {
+        if (levels[i].surf->win == w)
+            return &levels[i];
+    }
+    return NULL;
+}
+
+/* Row under window-relative y, or -1. */
+static int row_at(struct MenuLevel *l, int y) {
+    int item_y = y - config.border_width;
+    if (item_y < 0)
+        return -1;
+    int row = item_y / itemheight;
+    return row < visible_rows(l) ? l->top + row : -1;
+}
+
+/*
+ * Hover moved to another row of a level: repaint the old and new row only,
+ * close whatever was cascading from the old row and open the new row's
+ * submenu, if any.
+ */
+static void select_row(int depth, int i) {
+    struct MenuLevel *l = &levels[depth];
+    int prev = l->selected;
+    l->selected = i;
+    if (scroll_into_view(l, i)) {
+        draw_level(l);
+    } else {
+        if (prev >= 0 && prev < l->nitems)
+            draw_row(l, prev);
+        draw_row(l, i);
+    }
+    frame_pending = 1;
+    close_levels(depth + 1);
+    if (l->items[i].nsubitems > 0)
+        open_submenu(depth);
+    XFlush(dpy);
+}
+
+/* Map the submenu of the selected row of levels[depth] as the next level. */
+static void open_submenu(int depth) {
+    double start = monotonic_now();
+    struct MenuLevel *l = &levels[depth];
+    int row = l->selected;
+    struct Item *parent = &l->items[row];
+    if (parent->pipe)
+        pipe_opened(parent);
+    layout_submenu(parent);
+    struct Surface *s = submenu_surface(parent);
+
     int screen_width = DisplayWidth(dpy, screen);
     int screen_height = DisplayHeight(dpy, screen);
+    int x = l->x + l->surf->width + config.submenu_offset;
+    int y = l->y + ((row - l->top) * itemheight) + config.border_width;
     int proposed_x = x + config.submenu_offset;
-    if (proposed_x + submenu_width > screen_width)
-        proposed_x = menu_x - submenu_width - config.submenu_offset;
+    if (proposed_x + s->width > screen_width)
+        proposed_x = l->x - s->width - config.submenu_offset;
     if (proposed_x < 0)
         proposed_x = 0;
-    if (y + submenu_height > screen_height)
-        y = screen_height - submenu_height;
+    if (y + s->height > screen_height)
+        y = screen_height - s->height;
     if (y < 0)
         y = 0;
 
-    wa.colormap = menu_cmap;
-    wa.background_pixmap = None;
-    wa.background_pixel = config.bg;
-    wa.border_pixel = config.border_color;
-    wa.event_mask = ExposureMask | ButtonPressMask | PointerMotionMask | LeaveWindowMask;
-    wa.override_redirect = True;
-    submenu_win = XCreateWindow(dpy, root, proposed_x, y, submenu_width, submenu_height,
-                                config.border_width, menu_vi.depth, InputOutput, menu_vi.visual,
-                                CWColormap | CWBorderPixel | CWBackPixel | CWEventMask | CWOverrideRedirect, &wa);
-    submenu_draw = XftDrawCreate(dpy, submenu_win, menu_vi.visual, menu_cmap);
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-    if (!fmt) {
-        LOG("Error: No matching XRenderPictFormat for submenu visual");
-        fprintf(stderr, "gmenu: No matching XRenderPictFormat for submenu visual\n");
-        exit(1);
-    }
-    Picture pict = XRenderCreatePicture(dpy, submenu_win, fmt, 0, NULL);
-    if (!pict) {
-        LOG("Error: Failed to create picture for submenu window");
-        fprintf(stderr, "gmenu: Failed to create picture for submenu window\n");
-        exit(1);
-    }
-    XRenderColor bg = {
-        .red = ((config.bg >> 16) & 0xFF) * 0xFFFF / 0xFF,
-        .green = ((config.bg >> 8) & 0xFF) * 0xFFFF / 0xFF,
-        .blue = (config.bg & 0xFF) * 0xFFFF / 0xFF,
-        .alpha = config.alpha * 0xFFFF
-    };
-    XRenderFillRectangle(dpy, PictOpSrc, pict, &bg, 0, 0, submenu_width, submenu_height);
-    XRenderFreePicture(dpy, pict);
-    XMapRaised(dpy, submenu_win);
-    LOG("Created submenu window at (%d,%d) with size %dx%d", proposed_x, y, submenu_width, submenu_height);
+    levels = grow(levels, &levels_cap, depth + 2, sizeof(struct MenuLevel));
+    struct MenuLevel next = { parent->submenu, parent->nsubitems, s, -1, proposed_x, y };
+    levels[depth + 1] = next;
+    nlevels = depth + 2;
+    XMoveWindow(dpy, s->win, proposed_x, y);
+    XMapRaised(dpy, s->win);
+    LOG_DBG("menu", "Mapped level %d submenu at (%d,%d)", depth + 1, proposed_x, y);
+    hist_time(&hist_submenu, start);
 }
 
-static void destroy_submenu_window(void) {
-    if (submenu_win) {
-        if (submenu_draw) {
-            XftDrawDestroy(submenu_draw);
-            submenu_draw = NULL;
+/* Unmap every submenu level from depth up (depth >= 1). */
+static void close_levels(int depth) {
+    while (nlevels > depth && nlevels > 1) {
+        struct MenuLevel *l = &levels[nlevels - 1];
+        // Leave the buffer unselected and unscrolled so the next show needs no repaint.
+        if (l->top != 0) {
+            l->selected = -1;
+            l->top = 0;
+            draw_level(l);
+        } else if (l->selected != -1) {
+            int prev = l->selected;
+            l->selected = -1;
+            draw_row(l, prev);
         }
-        XDestroyWindow(dpy, submenu_win);
-        submenu_win = 0;
-        selected_subitem = -1;
-        LOG("Destroyed submenu window");
+        XUnmapWindow(dpy, l->surf->win);
+        discard_damage(l->surf);
+        nlevels--;
+        if (focus_depth >= nlevels)
+            focus_depth = nlevels - 1;
+        if (autoscroll_depth >= nlevels)
+            autoscroll_depth = -1;
+        LOG_DBG("menu", "Unmapped level %d submenu", nlevels);
     }
 }
 
-static void drawmenu(void) {
-    int y = config.border_width;
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-    if (!fmt) {
-        LOG("Error: No matching XRenderPictFormat for main menu in drawmenu");
-        fprintf(stderr, "gmenu: No matching XRenderPictFormat for main menu\n");
-        exit(1);
+/* Close every level, release the pointer and wait for the next Button3. */
+static void hide_menu(void) {
+    XUngrabPointer(dpy, CurrentTime);
+    XUngrabKeyboard(dpy, CurrentTime);
+    close_levels(1);
+    XUnmapWindow(dpy, win);
+    menu_mapped = 0;
+    autoscroll_depth = -1;
+    clear_filter();
+    menu_root = NULL;
+    if (recent_dirty)
+        update_recent_menu();
+    regrab_button();
+}
+
+static void handle_key(XKeyEvent *ev) {
+    char buf[32];
+    KeySym ksym = NoSymbol;
+    int len = XLookupString(ev, buf, sizeof(buf), &ksym, NULL);
+
+    switch (ksym) {
+    case XK_Escape:
+        if (query_len > 0)
+            clear_filter();
+        else
+            hide_menu();
+        break;
+    case XK_Up:
+    case XK_ISO_Left_Tab:
+        move_selection(-1);
+        break;
+    case XK_Down:
+    case XK_Tab:
+        move_selection(1);
+        break;
+    case XK_Page_Up:
+    case XK_Page_Down: {
+        struct MenuLevel *l = &levels[focus_depth];
+        int page = visible_rows(l) * (ksym == XK_Page_Up ? -1 : 1);
+        int row = l->selected < 0 ? l->top : l->selected + page;
+        row = row < 0 ? 0 : row >= l->nitems ? l->nitems - 1 : row;
+        if (l->nitems > 0 && row != l->selected && !l->items[row].separator)
+            select_row(focus_depth, row);
+        break;
     }
-    Picture pict = XRenderCreatePicture(dpy, win, fmt, 0, NULL);
-    if (!pict) {
-        LOG("Error: Failed to create picture in drawmenu");
-        fprintf(stderr, "gmenu: Failed to create picture for drawmenu\n");
-        exit(1);
+    case XK_Right:
+        if (levels[focus_depth].selected >= 0 &&
+            levels[focus_depth].items[levels[focus_depth].selected].nsubitems > 0)
+            activate_row();
+        break;
+    case XK_Left:
+        if (focus_depth > 0) {
+            close_levels(focus_depth);
+            XFlush(dpy);
+        }
+        break;
+    case XK_Return:
+    case XK_KP_Enter:
+        activate_row();
+        break;
+    case XK_BackSpace:
+        if (query_len > 0) {
+            query[--query_len] = '\0';
+            if (query_len > 0)
+                apply_filter(0);
+            else
+                clear_filter();
+        }
+        break;
+    default:
+        if (len == 1 && isprint((unsigned char)buf[0]) &&
+            query_len < (int)sizeof(query) - 1) {
+            query[query_len++] = tolower((unsigned char)buf[0]);
+            query[query_len] = '\0';
+            apply_filter(query_len > 1);
+        }
+        break;
     }
-    XRenderColor bg = {
-        .red = ((config.bg >> 16) & 0xFF) * 0xFFFF / 0xFF,
-        .green = ((config.bg >> 8) & 0xFF) * 0xFFFF / 0xFF,
-        .blue = (config.bg & 0xFF) * 0xFFFF / 0xFF,
-        .alpha = config.alpha * 0xFFFF
-    };
-    XRenderFillRectangle(dpy, PictOpSrc, pict, &bg, 0, 0, max_menuwidth, menuheight);
-    XRenderFreePicture(dpy, pict);
+}
+
+/* Move the keyboard selection in the focused level, skipping separators. */
+static void move_selection(int step) {
+    struct MenuLevel *l = &levels[focus_depth];
+    if (l->nitems == 0)
+        return;
+    int row = l->selected;
+    for (int tries = 0; tries < l->nitems; tries++) {
+        if (row < 0)
+            row = step > 0 ? 0 : l->nitems - 1;
+        else
+            row = (row + step + l->nitems) % l->nitems;
+        if (!l->items[row].separator)
+            break;
+    }
+    if (row != l->selected && !l->items[row].separator)
+        select_row(focus_depth, row);
+}
 
-    for (int i = 0; i < nitems; i++) {
-        draw_item(win, config.border_width, y,
-                  max_menuwidth - 2 * config.border_width,
-                  &items[i], i == selected_item);
-        y += itemheight;
+/* Enter on a command runs it; Enter or Right on a parent moves into its submenu. */
+static void activate_row(void) {
+    struct MenuLevel *l = &levels[focus_depth];
+    if (l->selected < 0)
+        return;
+    struct Item *item = &l->items[l->selected];
+    if (item->nsubitems > 0) {
+        if (nlevels <= focus_depth + 1)
+            open_submenu(focus_depth);
+        focus_depth++;
+        move_selection(1);
+    } else if (item->output_len > 0) {
+        LOG("launch", "Executing command: %s", ITEM_STR(item, item->output));
+        execute_command(ITEM_STR(item, item->output));
+        hide_menu();
     }
+}
 
-    // Submenu creation if hovered item has subitems
-    if (selected_item != -1 && items[selected_item].nsubitems > 0) {
-        if (selected_item != last_selected_item) {
-            int submenu_x = menu_x + max_menuwidth + config.submenu_offset;
-            int submenu_y = menu_y + (selected_item * itemheight) + config.border_width;
-            create_submenu_window(&items[selected_item], submenu_x, submenu_y);
-            draw_submenu(&items[selected_item]);
-            last_selected_item = selected_item;
+/* Index every entry with a command, at any depth, for type-to-filter. */
+static void build_search_index(void) {
+    nsearch = 0;
+    search_hay_len = 0;
+    for (int d = 0; d <= model.nsub; d++) {
+        int n = d == 0 ? model.nitems : model.sub[d - 1].n;
+        for (int i = 0; i < n; i++) {
+            struct Item *it = item_at(d, i);
+            if (it->separator || it->nsubitems > 0 || it->output_len == 0)
+                continue;
+            search_index = grow(search_index, &search_cap, nsearch + 1, sizeof(struct SearchEntry));
+            struct SearchEntry *e = &search_index[nsearch++];
+            // Label text without markup, segments joined by a space, lowercased.
+            size_t need = search_hay_len + 1;
+            for (int k = 0; k < it->nsegments; k++)
+                need += ITEM_SEG(it, k)->len + 1;
+            if (need > search_hay_cap) {
+                size_t newcap = search_hay_cap ? search_hay_cap * 2 : 4096;
+                while (newcap < need)
+                    newcap *= 2;
+                char *nh = realloc(search_hay, newcap);
+                if (!nh) {
+                    fprintf(stderr, "gmenu: Memory allocation failed for the search index\n");
+                    exit(1);
+                }
+                search_hay = nh;
+                search_hay_cap = newcap;
+            }
+            char *hay = search_hay + search_hay_len;
+            size_t len = 0;
+            e->mask = 0;
+            for (int k = 0; k < it->nsegments; k++) {
+                struct LabelSegment *seg = ITEM_SEG(it, k);
+                if (k > 0 && !seg->joined)
+                    hay[len++] = ' ';
+                for (unsigned int c = 0; c < seg->len; c++) {
+                    hay[len] = tolower((unsigned char)ITEM_STR(it, seg->text)[c]);
+                    e->mask |= 1ULL << ((unsigned char)hay[len++] & 63);
+                }
+            }
+            hay[len] = '\0';
+            e->item = it;
+            e->len = len;
+            e->hay = search_hay_len;
+            search_hay_len += len + 1;
         }
-    } else {
-        destroy_submenu_window();
-        last_selected_item = -1;
     }
-    XFlush(dpy);
+    LOG("search", "Index: %d entries", nsearch);
 }
 
-static void draw_submenu(struct Item *parent) {
-    if (!submenu_win)
-        return;
+static void free_search_index(void) {
+    free(search_index);
+    free(search_hay);
+    search_hay = NULL;
+    search_hay_len = search_hay_cap = 0;
+    free(matches);
+    free(results);
+    search_index = NULL;
+    matches = NULL;
+    results = NULL;
+    nsearch = -1;
+    search_cap = matches_cap = results_cap = nmatches = 0;
+}
 
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-    if (!fmt) {
-        LOG("Error: No matching XRenderPictFormat for submenu in draw_submenu");
-        fprintf(stderr, "gmenu: No matching XRenderPictFormat for submenu\n");
-        exit(1);
+/* Subsequence match of q in hay; NO_MATCH if absent, higher is better. */
+static int fuzzy_score(const char *hay, int hlen, const char *q, int qlen) {
+    int score = 0, h = 0, prev = -2;
+    for (int i = 0; i < qlen; i++) {
+        while (h < hlen && hay[h] != q[i])
+            h++;
+        if (h == hlen)
+            return NO_MATCH;
+        if (h == prev + 1)
+            score += 8;          // consecutive characters
+        if (h == 0 || hay[h - 1] == ' ')
+            score += 4;          // start of a word
+        if (prev >= 0 && h > prev + 1)
+            score--;             // gap since the last match
+        prev = h++;
     }
-    Picture pict = XRenderCreatePicture(dpy, submenu_win, fmt, 0, NULL);
-    if (!pict) {
-        LOG("Error: Failed to create picture in draw_submenu");
-        fprintf(stderr, "gmenu: Failed to create picture for draw_submenu\n");
-        exit(1);
-    }
-    XRenderColor bg = {
-        .red = ((config.bg >> 16) & 0xFF) * 0xFFFF / 0xFF,
-        .green = ((config.bg >> 8) & 0xFF) * 0xFFFF / 0xFF,
-        .blue = (config.bg & 0xFF) * 0xFFFF / 0xFF,
-        .alpha = config.alpha * 0xFFFF
-    };
+    return score * 256 - (hlen < 255 ? hlen : 255);
+}
 
-    int submenu_width = calculate_submenu_width(parent) + 2 * config.border_width;
-    int submenu_height = parent->nsubitems * itemheight + 2 * config.border_width;
+static int compare_matches(const void *a, const void *b) {
+    const struct SearchMatch *x = a, *y = b;
+    if (x->score != y->score)
+        return y->score - x->score;
+    return x->entry - y->entry;
+}
 
-    XRenderFillRectangle(dpy, PictOpSrc, pict, &bg, 0, 0, submenu_width, submenu_height);
-    XRenderFreePicture(dpy, pict);
+/*
+ * Recompute the result set for query and show it in place of the top level.
+ * With narrow set the previous matches are the candidates, since a query
+ * extended by one character can only match a subset of them.
+ */
+static void apply_filter(int narrow) {
+    if (nsearch < 0)
+        build_search_index();
 
-    int submenu_width_items = submenu_width - 2 * config.border_width;
+    unsigned long long qmask = 0;
+    for (int i = 0; i < query_len; i++)
+        qmask |= 1ULL << ((unsigned char)query[i] & 63);
 
-    for (int i = 0; i < parent->nsubitems; i++) {
-        draw_item(submenu_win, config.border_width, i * itemheight,
-                  submenu_width_items, &parent->submenu[i], i == selected_subitem);
+    int n = 0;
+    if (narrow) {
+        for (int i = 0; i < nmatches; i++) {
+            struct SearchEntry *e = &search_index[matches[i].entry];
+            int score = (e->mask & qmask) == qmask
+                        ? fuzzy_score(search_hay + e->hay, e->len, query, query_len) : NO_MATCH;
+            if (score != NO_MATCH) {
+                matches[n].entry = matches[i].entry;
+                matches[n++].score = score;
+            }
+        }
+    } else {
+        matches = grow(matches, &matches_cap, nsearch, sizeof(struct SearchMatch));
+        for (int i = 0; i < nsearch; i++) {
+            struct SearchEntry *e = &search_index[i];
+            if ((e->mask & qmask) != qmask)
+                continue;
+            int score = fuzzy_score(search_hay + e->hay, e->len, query, query_len);
+            if (score != NO_MATCH) {
+                matches[n].entry = i;
+                matches[n++].score = score;
+            }
+        }
+    }
+    nmatches = n;
+    qsort(matches, nmatches, sizeof(struct SearchMatch), compare_matches);
+
+    // Show as many results as fit on screen.
+    int rows = capped_rows(nmatches);
+    results = grow(results, &results_cap, rows > 0 ? rows : 1, sizeof(struct Item));
+    int width = max_menuwidth;
+    for (int i = 0; i < rows; i++) {
+        struct Item *it = search_index[matches[i].entry].item;
+        layout_item(it);
+        results[i] = *it;
+        int w = it->width + config.icon_left_padding + config.icon_right_padding + 20;
+        if (w > width)
+            width = w;
     }
 
+    close_levels(1);
+    focus_depth = 0;
+    levels[0].items = results;
+    levels[0].nitems = rows;
+    levels[0].top = 0;
+    levels[0].selected = rows > 0 ? 0 : -1;
+    fit_main_window(width, rows);
+    draw_level(&levels[0]);
+    present(&main_surf);
+    XFlush(dpy);
+    LOG_DBG("search", "Filter '%s': %d matches", query, nmatches);
+}
+
+/* Drop the query and put the top level back. */
+static void clear_filter(void) {
+    query_len = 0;
+    query[0] = '\0';
+    nmatches = 0;
+    if (nlevels == 0 || !results || levels[0].items != results)
+        return;
+    reset_top_level();
+    draw_level(&levels[0]);
+    present(&main_surf);
     XFlush(dpy);
 }
 
-static void draw_item(Window w, int x, int y, int width, struct Item *item, int selected) {
+/* Put the top level (or the submenu in menu_root) back into level 0. */
+static void reset_top_level(void) {
+    levels[0].selected = -1;
+    levels[0].top = 0;
+    focus_depth = 0;
+    if (menu_root) {
+        layout_submenu(menu_root);
+        levels[0].items = menu_root->submenu;
+        levels[0].nitems = menu_root->nsubitems;
+        fit_main_window(menu_root->submenu_width, menu_root->nsubitems);
+    } else {
+        levels[0].items = model.items;
+        levels[0].nitems = model.nitems;
+        fit_main_window(max_menuwidth, -1);
+    }
+}
+
+/* Resize the main window for rows of results (-1: the full top level), keeping it on screen. */
+static void fit_main_window(int width, int rows) {
+    int height = rows < 0 ? menuheight : (rows > 0 ? capped_rows(rows) : 1) * itemheight + 2 * config.border_width + 4;
+    surface_resize(&main_surf, width, height);
+    int x = levels[0].x, y = levels[0].y;
+    if (x + width > DisplayWidth(dpy, screen))
+        x = DisplayWidth(dpy, screen) - width;
+    if (y + height > DisplayHeight(dpy, screen))
+        y = DisplayHeight(dpy, screen) - height;
+    if (x < 0)
+        x = 0;
+    if (y < 0)
+        y = 0;
+    if (x != levels[0].x || y != levels[0].y) {
+        levels[0].x = x;
+        levels[0].y = y;
+        XMoveWindow(dpy, win, x, y);
+    }
+}
+
+static void draw_item(struct Surface *s, int x, int y, int width, struct Item *item, int selected) {
+    draw_item_background(s, x, y, width, item, selected);
+    raster_flush(s);
+    draw_item_text(s, x, y, width, item, selected);
+}
+
+/* The row's fills: everything the software renderer rasterizes itself. */
+static void draw_item_background(struct Surface *s, int x, int y, int width, struct Item *item, int selected) {
+    damage(s, x, y, width, itemheight);
+
     // If item is a separator, draw a horizontal line
     if (item->separator) {
         int padding = 1;
         int line_thickness = 1;
         int line_y = y + itemheight / 2;
-        XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-        Picture pict = XRenderCreatePicture(dpy, w, fmt, 0, NULL);
-
-        XRenderColor line_color = {
-            .red   = ((config.border_color >> 16) & 0xFF) * 0xFFFF / 0xFF,
-            .green = ((config.border_color >> 8)  & 0xFF) * 0xFFFF / 0xFF,
-            .blue  = ((config.border_color)       & 0xFF) * 0xFFFF / 0xFF,
-            .alpha = config.alpha * 0xFFFF
-        };
-        XRenderFillRectangle(dpy, PictOpSrc, pict, &line_color,
-                             x + padding, line_y, width - 2 * padding, line_thickness);
+        paint_fill(s, &palette.bg, x, y, width, itemheight);
+        paint_fill(s, &palette.separator, x + padding, line_y, width - 2 * padding, line_thickness);
+        return;
+    }
 
-        XRenderFreePicture(dpy, pict);
+    if (selected && s->pixels && config.corner_radius > 0) {
+        // A rounded selection inset from the row, over a soft shadow.
+        paint_fill(s, &palette.bg, x, y, width, itemheight);
+        // The feather grows the shadow by 2 px; it must stay within the row,
+        // since only the rows whose selection changes are repainted.
+        if (config.shadow > 0)
+            raster_round_rect(s, x + 2, y + 2, width - 4, itemheight - 4, config.corner_radius, 3,
+                              (uint32_t)(config.shadow * 255) << 24);
+        raster_round_rect(s, x + 2, y + 1, width - 4, itemheight - 2, config.corner_radius, 1,
+                          pack_color(&palette.selbg));
         return;
     }
 
+    // Fill the row with the selected or normal background
+    paint_fill(s, selected ? &palette.selbg : &palette.bg, x, y, width, itemheight);
+}
+
+/* The row's icon and text, drawn by the server over the background. */
+static void draw_item_text(struct Surface *s, int x, int y, int width, struct Item *item, int selected) {
+    Picture pict = s->pict;
+    XftDraw *draw = s->draw;
+    if (item->separator)
+        return;
+
     // text_x offset for icons/padding
     int text_x = x
                  + config.icon_left_padding
-                 + (w == submenu_win ? SUBMENU_INDENT : 0);
+                 + (s != &main_surf ? SUBMENU_INDENT : 0);
 
     // center text vertically
-    int text_y = y + (itemheight + xft_font->ascent - xft_font->descent) / 2;
-
-    // fill background with appropriate transparency
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, menu_vi.visual);
-    Picture pict = XRenderCreatePicture(dpy, w, fmt, 0, NULL);
-
-    double alpha_val = selected ? config.selalpha : config.alpha;
-    XRenderColor item_bg = {
-        .red   = (((selected ? config.selbg : config.bg) >> 16) & 0xFF) * 0xFFFF / 0xFF,
-        .green = (((selected ? config.selbg : config.bg) >> 8)  & 0xFF) * 0xFFFF / 0xFF,
-        .blue  = ((selected ? config.selbg : config.bg) & 0xFF) * 0xFFFF / 0xFF,
-        .alpha = alpha_val * 0xFFFF
-    };
+    int text_y = y + text_baseline;
 
-    // Fill the row
-    XRenderFillRectangle(dpy, PictOpSrc, pict, &item_bg, x, y, width, itemheight);
-    XRenderFreePicture(dpy, pict);
+    // The icon is one cell of the atlas; rows keep its space while it loads.
+    if (item->icon_slot && item->icon_slot <= atlas_count && atlas_size == icon_size) {
+        int slot = item->icon_slot - 1;
+        XRenderComposite(dpy, PictOpOver, icon_atlas, None, pict,
+                         slot % atlas_cols * atlas_size, slot / atlas_cols * atlas_size, 0, 0,
+                         text_x, y + (itemheight - atlas_size) / 2, atlas_size, atlas_size);
+    }
 
     // Draw segments if any
-    if (item->nsegments > 0) {
-        for (int i = 0; i < item->nsegments; i++) {
-            XRenderColor render_color = {
-                .red   = ((item->segments[i].color >> 16) & 0xFF) * 0xFFFF / 0xFF,
-                .green = ((item->segments[i].color >> 8)  & 0xFF) * 0xFFFF / 0xFF,
-                .blue  = ((item->segments[i].color)       & 0xFF) * 0xFFFF / 0xFF,
-                .alpha = 0xFFFF
-            };
-            XftColor seg_color;
-            XftColorAllocValue(dpy, menu_vi.visual, menu_cmap, &render_color, &seg_color);
-
-            // If hovered, override color with selfg
-            XftColor *draw_color = selected ? &xft_selfg : &seg_color;
-
-            // Draw this segment
-            XftDrawStringUtf8(
-                (w == win) ? main_draw : submenu_draw,
-                draw_color, xft_font,
-                text_x, text_y,
-                (FcChar8 *)item->segments[i].text,
-                strlen(item->segments[i].text)
-            );
-
-            // measure the segment’s width
-            XGlyphInfo extents;
-            XftTextExtentsUtf8(dpy, xft_font,
-                               (FcChar8 *)item->segments[i].text,
-                               strlen(item->segments[i].text), &extents);
-            int seg_width = extents.xOff;
-
-            text_x += seg_width;
-            XftColorFree(dpy, menu_vi.visual, menu_cmap, &seg_color);
-        }
-    } else {
-        // plain text
+    for (int i = 0; i < item->nsegments; i++) {
+        struct LabelSegment *seg = ITEM_SEG(item, i);
+        // If hovered, override color with selfg
+        XftColor *draw_color = selected ? &palette.selfg : &seg->xft_color;
+
+        // Draw this segment
         XftDrawStringUtf8(
-            (w == win) ? main_draw : submenu_draw,
-            selected ? &xft_selfg : &xft_fg,
-            xft_font,
-            text_x, text_y,
-            (FcChar8 *)item->label,
-            strlen(item->label)
+            draw,
+            draw_color, font_at(seg->font),
+            text_x + seg->x, text_y,
+            (FcChar8 *)ITEM_STR(item, seg->text),
+            seg->len
         );
     }
 
-    // Draw arrow if this is a main menu item with a submenu
-    if (w == win && item->nsubitems > 0) {
+    // Draw arrow if this item opens a submenu
+    if (item->nsubitems > 0) {
         char arrow[] = "▶";
-        XGlyphInfo extents;
-        XftTextExtentsUtf8(dpy, xft_font, (FcChar8 *)arrow, strlen(arrow), &extents);
-        int arrow_width = extents.xOff;
         int arrow_x = x + width - arrow_width - 10;
 
         XftDrawStringUtf8(
-            main_draw,
-            selected ? &xft_selfg : &xft_fg,
-            xft_font,
+            draw,
+            selected ? &palette.selfg : &palette.fg,
+            arrow_font,
             arrow_x, text_y,
             (FcChar8 *)arrow, strlen(arrow)
         );
@@ -707,167 +4837,146 @@ static void draw_item(Window w, int x, int y, int width, struct Item *item, int
 }
 
 static int is_menu_mapped(void) {
-    XWindowAttributes wa;
-    if (!XGetWindowAttributes(dpy, win, &wa))
-        return 0;
-    return wa.map_state == IsViewable;
+    return menu_mapped;
 }
 
 static void handle_event(XEvent *ev) {
+    struct MenuLevel *l;
+    rows_repainted = 0;
+    input_time = monotonic_now();
+    if (!frame_pending) {
+        frame_input_time = input_time;
+        frame_requests = NextRequest(dpy);
+    }
     switch (ev->type) {
     case Expose:
-        if (ev->xexpose.window == win) {
-            drawmenu();
-        } else if (ev->xexpose.window == submenu_win &&
-                   selected_item != -1 && items[selected_item].nsubitems > 0) {
-            draw_submenu(&items[selected_item]);
+        // The back buffer already holds the frame; just copy the exposed rectangle.
+        if ((l = level_of(ev->xexpose.window))) {
+            damage(l->surf, ev->xexpose.x, ev->xexpose.y, ev->xexpose.width, ev->xexpose.height);
+            present(l->surf);
+            XFlush(dpy);
         }
         break;
 
     case ButtonPress:
         if (ev->xbutton.button == Button3) {
-            Window root_return, child_return;
-            int root_x, root_y, win_x, win_y;
-            unsigned int mask;
-            if (XQueryPointer(dpy, root, &root_return, &child_return,
-                              &root_x, &root_y, &win_x, &win_y, &mask)) {
-                if (child_return == None && ev->xbutton.window == root) {
-                    if (!is_menu_mapped()) {
-                        show_menu(ev->xbutton.x_root, ev->xbutton.y_root);
-                        LOG("Menu shown at (%d,%d)", ev->xbutton.x_root, ev->xbutton.y_root);
-                    }
-                    XAllowEvents(dpy, SyncPointer, CurrentTime);
-                } else {
-                    XAllowEvents(dpy, ReplayPointer, CurrentTime);
-                }
-            }
-        } else if (ev->xbutton.window == win) {
-            int y = ev->xbutton.y;
-            if (y >= 0 && y < menuheight) {
-                int item_y = y - config.border_width;
-                selected_item = item_y / itemheight;
-                if (selected_item >= 0 && selected_item < nitems) {
-                    if (items[selected_item].nsubitems == 0 &&
-                        items[selected_item].output[0] != '\0') {
-                        LOG("Executing command: %s", items[selected_item].output);
-                        execute_command(items[selected_item].output);
-                        XUngrabPointer(dpy, CurrentTime);
-                        XUnmapWindow(dpy, win);
-                        regrab_button();
-                    }
+            // The grab is on root, so subwindow is the top-level window under the pointer.
+            if (ev->xbutton.subwindow == None && ev->xbutton.window == root) {
+                if (!is_menu_mapped()) {
+                    show_menu(ev->xbutton.x_root, ev->xbutton.y_root, NULL);
+                    LOG("menu", "Menu shown at (%d,%d)", ev->xbutton.x_root, ev->xbutton.y_root);
                 }
+                XAllowEvents(dpy, SyncPointer, CurrentTime);
+            } else {
+                XAllowEvents(dpy, ReplayPointer, CurrentTime);
             }
-        } else if (ev->xbutton.window == submenu_win) {
-            int y = ev->xbutton.y;
-            int sub_y = y - config.border_width;
-            selected_subitem = sub_y / itemheight;
-            if (selected_subitem >= 0 &&
-                selected_subitem < items[selected_item].nsubitems) {
-                LOG("Executing submenu command: %s",
-                    items[selected_item].submenu[selected_subitem].output);
-                execute_command(items[selected_item].submenu[selected_subitem].output);
-                XUngrabPointer(dpy, CurrentTime);
-                destroy_submenu_window();
-                XUnmapWindow(dpy, win);
-                regrab_button();
+        } else if ((l = level_of(ev->xbutton.window)) &&
+                   (ev->xbutton.button == Button4 || ev->xbutton.button == Button5)) {
+            int depth = l - levels;
+            scroll_level(depth, ev->xbutton.button == Button4 ? -WHEEL_ROWS : WHEEL_ROWS);
+            int row = row_at(l, ev->xbutton.y);
+            if (row >= 0 && row != l->selected)
+                select_row(depth, row);
+        } else if ((l = level_of(ev->xbutton.window))) {
+            int row = row_at(l, ev->xbutton.y);
+            if (row >= 0 && l->items[row].nsubitems == 0 &&
+                l->items[row].output_len > 0) {
+                LOG("launch", "Executing command: %s", ITEM_STR(&l->items[row], l->items[row].output));
+                execute_command(ITEM_STR(&l->items[row], l->items[row].output));
+                hide_menu();
             }
         } else if (is_menu_mapped()) {
-            XUngrabPointer(dpy, CurrentTime);
-            destroy_submenu_window();
-            XUnmapWindow(dpy, win);
-            regrab_button();
+            hide_menu();
         }
         break;
 
     case MotionNotify:
-        if (ev->xmotion.window == win) {
-            int y = ev->xmotion.y;
-            if (y >= 0 && y < menuheight) {
-                int item_y = y - config.border_width;
-                int new_selected_item = item_y / itemheight;
-                if (new_selected_item >= 0 && new_selected_item < nitems &&
-                    new_selected_item != selected_item) {
-                    selected_item = new_selected_item;
-                    selected_subitem = -1;
-                    drawmenu();
-                }
-            }
-        } else if (ev->xmotion.window == submenu_win) {
-            int y = ev->xmotion.y;
-            int sub_y = y - config.border_width;
-            int new_selected_subitem = sub_y / itemheight;
-            if (new_selected_subitem >= 0 &&
-                new_selected_subitem < items[selected_item].nsubitems &&
-                new_selected_subitem != selected_subitem) {
-                selected_subitem = new_selected_subitem;
-                draw_submenu(&items[selected_item]);
+        // Only where the pointer ended up matters: skip motion already queued behind this one.
+        while (XEventsQueued(dpy, QueuedAlready) > 0) {
+            XEvent next;
+            XPeekEvent(dpy, &next);
+            if (next.type != MotionNotify || next.xmotion.window != ev->xmotion.window)
+                break;
+            XNextEvent(dpy, ev);
+            motion_coalesced++;
+        }
+        if ((l = level_of(ev->xmotion.window))) {
+            // select_row may open a submenu and move levels: keep the index, not l.
+            int depth = l - levels;
+            int row = row_at(l, ev->xmotion.y);
+            focus_depth = depth;
+            if (row >= 0 && row != l->selected) {
+                select_row(depth, row);
+                frame_hover = 1;
             }
+            update_autoscroll(depth, row);
         }
         break;
 
+    case KeyPress:
+        if (nlevels > 0)
+            handle_key(&ev->xkey);
+        break;
+
     case LeaveNotify: {
-        if (ev->xcrossing.window == win || ev->xcrossing.window == submenu_win) {
+        if (level_of(ev->xcrossing.window)) {
             struct timeval current_time;
             gettimeofday(&current_time, NULL);
             double time_elapsed = (current_time.tv_sec - menu_open_time.tv_sec) +
                                   (current_time.tv_usec - menu_open_time.tv_usec) / 1000000.0;
             if (time_elapsed < GRACE_PERIOD_SECONDS)
                 return;
-            int root_x, root_y, win_x, win_y;
-            Window root_ret, child;
-            unsigned int mask;
-            if (XQueryPointer(dpy, root, &root_ret, &child,
-                              &root_x, &root_y, &win_x, &win_y, &mask)) {
-                int is_over_main = (root_x >= menu_x && root_x < menu_x + max_menuwidth &&
-                                    root_y >= menu_y && root_y < menu_y + menuheight);
-                int is_over_submenu = 0;
-                if (submenu_win) {
-                    XWindowAttributes wa;
-                    if (XGetWindowAttributes(dpy, submenu_win, &wa)) {
-                        is_over_submenu = (root_x >= wa.x && root_x < wa.x + wa.width &&
-                                           root_y >= wa.y && root_y < wa.y + wa.height);
-                    }
-                }
-                if (!is_over_main && !is_over_submenu) {
-                    XUngrabPointer(dpy, CurrentTime);
-                    if (submenu_win)
-                        destroy_submenu_window();
-                    XUnmapWindow(dpy, win);
-                    regrab_button();
-                }
+            // The event carries where the pointer went; the level geometry is our own.
+            int root_x = ev->xcrossing.x_root, root_y = ev->xcrossing.y_root;
+            int is_over_menu = 0;
+            for (int i = 0; i < nlevels && !is_over_menu; i++) {
+                struct MenuLevel *o = &levels[i];
+                is_over_menu = (root_x >= o->x && root_x < o->x + o->surf->width &&
+                                root_y >= o->y && root_y < o->y + o->surf->height);
             }
+            if (!is_over_menu)
+                hide_menu();
         }
     } break;
+
+    case UnmapNotify:
+        // Only gmenu maps and unmaps its windows; this catches anything else doing it.
+        if (ev->xunmap.window == win && menu_mapped && ev->xany.serial >= map_serial) {
+            LOG_WARNING("menu", "Menu window was unmapped behind our back");
+            hide_menu();
+        }
+        break;
     }
+    if (rows_repainted)
+        LOG_DBG("event", "Event %d repainted %d rows", ev->type, rows_repainted);
 }
 
-static void show_menu(int x, int y) {
-    selected_item = -1;
-    selected_subitem = -1;
-    int screen_width = DisplayWidth(dpy, screen);
-    int screen_height = DisplayHeight(dpy, screen);
-    if (x + max_menuwidth > screen_width)
-        x = screen_width - max_menuwidth;
-    if (y + menuheight > screen_height)
-        y = screen_height - menuheight;
-    if (x < 0)
-        x = 0;
-    if (y < 0)
-        y = 0;
-    menu_x = x;
-    menu_y = y;
-    XMoveWindow(dpy, win, x, y);
+/* Open the menu at (x, y); with menu set, that submenu stands in for the top level. */
+static void show_menu(int x, int y, struct Item *menu) {
+    levels = grow(levels, &levels_cap, 1, sizeof(struct MenuLevel));
+    struct MenuLevel top = { model.items, model.nitems, &main_surf, -1, x, y };
+    levels[0] = top;
+    nlevels = 1;
+    menu_root = menu;
+    reset_top_level();
+    XMoveWindow(dpy, win, levels[0].x, levels[0].y);
+    map_serial = NextRequest(dpy);
     XMapRaised(dpy, win);
+    menu_mapped = 1;
     drawmenu();
-    XSync(dpy, False);
-    XGrabPointer(dpy, root, True,
-                 ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
-                 EnterWindowMask | LeaveWindowMask,
-                 GrabModeAsync, GrabModeAsync, None, None, CurrentTime);
+    // The grabs must wait for their status; that reply also means the frame was painted.
+    ROUND_TRIP(XGrabPointer(dpy, root, True,
+                            ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
+                            EnterWindowMask | LeaveWindowMask,
+                            GrabModeAsync, GrabModeAsync, None, None, CurrentTime));
+    hist_time(&hist_show, input_time);
+    ROUND_TRIP(XGrabKeyboard(dpy, win, True, GrabModeAsync, GrabModeAsync, CurrentTime));
     XSetInputFocus(dpy, win, RevertToPointerRoot, CurrentTime);
     XUngrabButton(dpy, Button3, AnyModifier, root);
+    XFlush(dpy);
     gettimeofday(&menu_open_time, NULL);
-    LOG("Menu displayed at (%d,%d)", x, y);
+    nshows++;
+    LOG("menu", "Menu displayed at (%d,%d)", levels[0].x, levels[0].y);
 }
 
 static void regrab_button(void) {
@@ -876,9 +4985,9 @@ static void regrab_button(void) {
 }
 
 static void load_config(const char *path) {
-    FILE *fp = fopen(path, "r");
+    FILE *fp = fopen(path, "re");
     if (!fp) {
-        LOG("No config file found at %s, using defaults", path);
+        LOG("config", "No config file found at %s, using defaults", path);
         return;
     }
 
@@ -904,60 +5013,100 @@ static void load_config(const char *path) {
                     free(config.font);
 
                 config.font = strdup(value);
-                LOG("Config: font set to %s", value);
+                LOG("config", "font set to %s", value);
 
             } else if (strcmp(key, "foreground") == 0) {
                 // value expected like "#F62198"; skip '#' by using (value + 1)
                 config.fg = strtoul(value + 1, NULL, 16);
-                LOG("Config: foreground set to %s", value);
+                LOG("config", "foreground set to %s", value);
 
             } else if (strcmp(key, "background") == 0) {
                 config.bg = strtoul(value + 1, NULL, 16);
-                LOG("Config: background set to %s", value);
-                printf("Loaded background color: 0x%06lx\n", config.bg);
+                LOG("config", "background set to %s", value);
 
             } else if (strcmp(key, "selected_fg") == 0) {
                 config.selfg = strtoul(value + 1, NULL, 16);
-                LOG("Config: selected_fg set to %s", value);
+                LOG("config", "selected_fg set to %s", value);
 
             } else if (strcmp(key, "selected_bg") == 0) {
                 config.selbg = strtoul(value + 1, NULL, 16);
-                LOG("Config: selected_bg set to %s", value);
+                LOG("config", "selected_bg set to %s", value);
 
             } else if (strcmp(key, "border_color") == 0) {
                 config.border_color = strtoul(value + 1, NULL, 16);
-                LOG("Config: border_color set to %s", value);
-                printf("Loaded border color: 0x%06lx\n", config.border_color);
+                LOG("config", "border_color set to %s", value);
 
             } else if (strcmp(key, "transparency") == 0) {
                 // Normal (non-hover) alpha
                 config.alpha = atof(value);
-                LOG("Config: transparency set to %s", value);
+                LOG("config", "transparency set to %s", value);
 
             } else if (strcmp(key, "hover_transparency") == 0) {
                 // Hover (selected) alpha
                 config.selalpha = atof(value);
-                LOG("Config: hover_transparency set to %s", value);
+                LOG("config", "hover_transparency set to %s", value);
 
             } else if (strcmp(key, "border_width") == 0) {
                 config.border_width = atoi(value);
-                LOG("Config: border_width set to %s", value);
+                LOG("config", "border_width set to %s", value);
 
             } else if (strcmp(key, "submenu_offset") == 0) {
                 config.submenu_offset = atoi(value);
-                LOG("Config: submenu_offset set to %s", value);
+                LOG("config", "submenu_offset set to %s", value);
 
             } else if (strcmp(key, "mouse_delay") == 0) {
                 config.mouse_delay = atof(value);
-                LOG("Config: mouse_delay set to %s", value);
+                LOG("config", "mouse_delay set to %s", value);
 
             } else if (strcmp(key, "icon_left_padding") == 0) {
                 config.icon_left_padding = atoi(value);
-                LOG("Config: icon_left_padding set to %s", value);
+                LOG("config", "icon_left_padding set to %s", value);
 
             } else if (strcmp(key, "icon_right_padding") == 0) {
                 config.icon_right_padding = atoi(value);
-                LOG("Config: icon_right_padding set to %s", value);
+                LOG("config", "icon_right_padding set to %s", value);
+
+            } else if (strcmp(key, "pipe_ttl") == 0) {
+                config.pipe_ttl = atof(value);
+                LOG("config", "pipe_ttl set to %s", value);
+            } else if (strcmp(key, "pipe_timeout") == 0) {
+                config.pipe_timeout = atof(value);
+                LOG("config", "pipe_timeout set to %s", value);
+            } else if (strcmp(key, "renderer") == 0) {
+                config.renderer = strcmp(value, "software") == 0 ? RENDER_SOFTWARE : RENDER_XRENDER;
+                LOG("config", "renderer set to %s", value);
+            } else if (strcmp(key, "corner_radius") == 0) {
+                config.corner_radius = atoi(value);
+                LOG("config", "corner_radius set to %s", value);
+            } else if (strcmp(key, "shadow") == 0) {
+                config.shadow = atof(value);
+                LOG("config", "shadow set to %s", value);
+            } else if (strcmp(key, "font_fallback") == 0) {
+                snprintf(config.font_fallback, sizeof(config.font_fallback), "%s", value);
+                LOG("config", "font_fallback set to %s", value);
+            } else if (strcmp(key, "icon_theme") == 0) {
+                snprintf(config.icon_theme, sizeof(config.icon_theme), "%s", value);
+                LOG("config", "icon_theme set to %s", value);
+            } else if (strcmp(key, "refresh_rate") == 0) {
+                config.refresh_rate = atoi(value);
+                LOG("config", "refresh_rate set to %s", value);
+            } else if (strcmp(key, "recent_items") == 0) {
+                config.recent_items = atoi(value);
+                LOG("config", "recent_items set to %s", value);
+
+            } else if (strcmp(key, "log_file") == 0) {
+                snprintf(config.log_file, sizeof(config.log_file), "%s", value);
+
+            } else if (strcmp(key, "log_level") == 0) {
+                const char *names[] = { "error", "warn", "info", "debug" };
+                for (int i = 0; i < 4; i++)
+                    if (strcmp(value, names[i]) == 0)
+                        config.log_level = i;
+                LOG("config", "log_level set to %s", value);
+
+            } else if (strcmp(key, "applications") == 0) {
+                config.applications = strcmp(value, "true") == 0 || atoi(value) > 0;
+                LOG("config", "applications set to %s", value);
             }
         }
     }
@@ -965,58 +5114,309 @@ static void load_config(const char *path) {
 }
 
 
+/* Release the segment colors allocated by add_run and the model arrays. */
+static void free_model(void) {
+    free_search_index();
+    pipe_detach();
+    free(recent_label);
+    recent_label = NULL;
+    recent_rows = 0;
+    for (int i = 0; dpy && i < model.nsegments; i++)
+        XftColorFree(dpy, menu_vi.visual, menu_cmap, &model.segments[i].xft_color);
+    free(model.segments);
+    free(model.items);
+    for (int d = 0; d < model.nsub; d++)
+        free(model.sub[d].v);
+    free(model.sub);
+    free(model.strings);
+    memset(&model, 0, sizeof(model));
+}
+
 static void cleanup(void) {
-    destroy_submenu_window();
-    for (int i = 0; i < nitems; i++) {
-        free(items[i].submenu);
-        items[i].submenu = NULL;
-        items[i].nsubitems = 0;
+    if (control_fd >= 0) {
+        struct sockaddr_un addr;
+        control_socket_path(&addr);  // Private, or control_fd would be -1.
+        close(control_fd);
+        unlink(addr.sun_path);
     }
+    for (int i = 0; i < ncontrol_clients; i++)
+        close(control_clients[i].fd);
+    free_submenu_windows();
+    free_model();
+    free_pipes();
+    free_icons();
+    free(levels);
     if (config.font && strcmp(config.font, "fixed") != 0)
         free(config.font);
-    if (xft_font)
-        XftFontClose(dpy, xft_font);
-    if (main_draw)
-        XftDrawDestroy(main_draw);
-    if (submenu_draw)
-        XftDrawDestroy(submenu_draw);
-    XftColorFree(dpy, menu_vi.visual, menu_cmap, &xft_fg);
-    XftColorFree(dpy, menu_vi.visual, menu_cmap, &xft_selfg);
+    free_fonts();
+    surface_free(&main_surf);
+    XftColorFree(dpy, menu_vi.visual, menu_cmap, &palette.fg);
+    XftColorFree(dpy, menu_vi.visual, menu_cmap, &palette.selfg);
     XFreeGC(dpy, gc);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
-    LOG("Cleanup complete");
+    LOG("gmenu", "Cleanup complete");
+    log_shutdown();
 }
 
-static int text_width(const char *text) {
-    if (!xft_font)
+static int text_width(XftFont *font, const char *text, int len) {
+    if (!font)
         return 0;
     XGlyphInfo extents;
-    XftTextExtents8(dpy, xft_font, (FcChar8 *)text, strlen(text), &extents);
+    XftTextExtentsUtf8(dpy, font, (FcChar8 *)text, len, &extents);
     return extents.xOff;
 }
 
+/*
+ * Launch a command detached from gmenu, in its own session. Commands with
+ * no shell syntax are split on whitespace and exec'd directly; anything
+ * else goes through /bin/sh -c. A command whose first word is "bash" runs
+ * in TERMINAL, as it always has.
+ */
 static void execute_command(const char *cmd) {
     if (!cmd || !*cmd)
         return;
-    pid_t pid = fork();
-    if (pid == -1) {
-        LOG("Error: fork failed for command '%s'", cmd);
-        perror("gmenu: fork failed");
+
+    char buf[4096];
+    char *argv[64];
+    int argc = 0;
+    if (strlen(cmd) < sizeof(buf) && !strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~={}%!\n")) {
+        snprintf(buf, sizeof(buf), "%s", cmd);
+        char *save;
+        for (char *w = strtok_r(buf, " \t", &save); w && argc < 63; w = strtok_r(NULL, " \t", &save))
+            argv[argc++] = w;
+        if (argc == 63)
+            argc = 0;  // too many words to be worth splitting by hand
+    }
+
+    char *term[16];
+    int nterm = 0;
+    char term_buf[sizeof(TERMINAL)];
+    int in_terminal = strncmp(cmd, "bash", 4) == 0 && (!cmd[4] || isspace((unsigned char)cmd[4]));
+    if (in_terminal) {
+        memcpy(term_buf, TERMINAL, sizeof(term_buf));
+        char *save;
+        for (char *w = strtok_r(term_buf, " ", &save); w && nterm < 15; w = strtok_r(NULL, " ", &save))
+            term[nterm++] = w;
+    }
+
+    // Final argv: [terminal words] then either the split words or sh -c cmd.
+    char *args[64 + 16 + 4];
+    int n = 0;
+    for (int i = 0; i < nterm; i++)
+        args[n++] = term[i];
+    if (argc > 0) {
+        for (int i = 0; i < argc; i++)
+            args[n++] = argv[i];
+    } else {
+        args[n++] = "/bin/sh";
+        args[n++] = "-c";
+        args[n++] = (char *)cmd;
+    }
+    args[n] = NULL;
+
+    posix_spawnattr_t attr;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask(&attr, &none);
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], NULL, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        LOG_ERR("launch", "cannot run '%s': %s", cmd, strerror(err));
+        fprintf(stderr, "gmenu: cannot run '%s': %s\n", cmd, strerror(err));
         return;
     }
-    if (pid == 0) {
-        char *bg_cmd;
-        if (strncmp(cmd, "bash", 4) == 0) {
-            asprintf(&bg_cmd, "%s %s &", TERMINAL, cmd);
-        } else {
-            asprintf(&bg_cmd, "%s &", cmd);
+    nlaunches++;
+    usage_record(cmd);
+    hist_time(&hist_launch, input_time);
+    LOG("launch", "Launched pid %d (%s) in %.2f ms: %s", (int)pid,
+        argc > 0 ? "direct" : "shell", hist_launch.last / 1000.0, cmd);
+}
+
+/* SIGCHLD and SIGUSR1 only wake run(); children are reaped and stats dumped there. */
+static void wake_handler(int sig) {
+    int saved = errno;
+    if (sig == SIGUSR1)
+        stats_requested = 1;
+    if (write(wake_pipe[1], "", 1) < 0) {
+        // The pipe is full, so run() is due to wake up anyway.
+    }
+    errno = saved;
+}
+
+static void setup_child_reaping(void) {
+    if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        // Without the pipe, let the kernel reap children itself.
+        signal(SIGCHLD, SIG_IGN);
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void reap_children(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        // Once reaped, a generator's pid and group may be reused: never signal them again.
+        for (int i = 0; i < npipes; i++)
+            if (pipes[i].pid == pid)
+                pipes[i].pid = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            LOG_WARNING("launch", "Child %d exited with status %d", (int)pid, WEXITSTATUS(status));
+        else if (WIFSIGNALED(status))
+            LOG_WARNING("launch", "Child %d killed by signal %d", (int)pid, WTERMSIG(status));
+    }
+}
+
+#ifdef GMENU_FUZZ
+/*
+ * Parser drivers, built without a display: "make fuzz" links the libFuzzer
+ * entry point below, "make parse-bench" adds a main that runs files through
+ * it (for AFL or by hand) and times the parser on generated item files.
+ */
+static int fuzz_parse(const uint8_t *data, size_t size, const char *name) {
+    struct ParseState ps = {0};
+    ps.file = name;
+    parse_items((const char *)data, size, &ps);
+    free(ps.path);  // No fixup_submenus: pipe_attach would run the generators.
+    free_model();
+    free_icons();
+    return ps.errors;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_parse(data, size, "input");
+    log_tail = log_head;  // Nobody reads the diagnostics here.
+    return 0;
+}
+
+#ifdef GMENU_FUZZ_MAIN
+#undef main
+
+/* Copy the queued log lines to stderr. */
+static void drain_log(void) {
+    for (; log_tail != log_head; log_tail++) {
+        struct LogSlot *slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        fwrite(slot->line, 1, slot->len, stderr);
+    }
+}
+
+/* Write about size bytes of item lines covering all of the syntax. */
+static int generate_items(FILE *fp, size_t size) {
+    static const char *colors[] = { "#0078D7", "#e5c07b", "98c379", "#c678dd" };
+    size_t written = 0;
+    int n = 0;
+    while (written < size) {
+        const char *c = colors[n % 4];
+        int len;
+        switch (n % 8) {
+        case 0:
+            len = fprintf(fp, "___\nGroup %d = xdg-open ~/group-%d\n", n, n);
+            break;
+        case 1:
+            len = fprintf(fp, "<color='%s'>Tag</color> Application %d = app-%d --new-window\n", c, n, n);
+            break;
+        case 2:
+            len = fprintf(fp, "== <icon='app-%d'> Submenu entry %d = run %d\n", n % 64, n, n);
+            break;
+        case 3:
+            len = fprintf(fp, "==== Nested <color='%s'>entry <color='#ff0000'>%d</color> deep</color> = nested %d\n", c, n, n);
+            break;
+        case 4:
+            len = fprintf(fp, "== Pipe %d |= printf 'a = b\\n'\r\n", n);
+            break;
+        default:
+            len = fprintf(fp, "Plain entry number %d with a longer label = /usr/bin/command-%d --flag\n", n, n);
+            break;
+        }
+        if (len < 0)
+            return -1;
+        written += len;
+        n++;
+    }
+    return 0;
+}
+
+/* Time the parser on generated files of a few sizes; one JSON line each. */
+static int parse_bench(void) {
+    static const size_t sizes[] = { 1 << 20, 4 << 20, 16 << 20 };
+    enum { RUNS = 5 };
+    config.log_level = LOG_ERROR;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char path[] = "/tmp/gmenu-parse-XXXXXX";
+        int fd = mkstemp(path);
+        FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+        if (!fp || generate_items(fp, sizes[i]) < 0 || fclose(fp) != 0) {
+            fprintf(stderr, "gmenu-parse: cannot write %s\n", path);
+            unlink(path);
+            return 1;
+        }
+        double best = 0;
+        size_t bytes = 0;
+        int items = 0, errors = 0;
+        for (int run = 0; run < RUNS; run++) {
+            double start = monotonic_now();
+            struct Mapping m;
+            struct ParseState ps = {0};
+            ps.file = path;
+            if (!map_file(path, &m)) {
+                fprintf(stderr, "gmenu-parse: cannot read %s\n", path);
+                unlink(path);
+                return 1;
+            }
+            parse_items(m.data, m.len, &ps);
+            bytes = m.len;
+            unmap_file(&m);
+            double elapsed = monotonic_now() - start;
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+            items = model.nitems;
+            for (int d = 0; d < model.nsub; d++)
+                items += model.sub[d].n;
+            errors = ps.errors;
+            free(ps.path);
+            free_model();
+            free_icons();
+        }
+        unlink(path);
+        printf("{\"bytes\": %zu, \"items\": %d, \"errors\": %d, \"best_ms\": %.3f, \"mb_per_s\": %.1f}\n",
+               bytes, items, errors, best * 1e3, bytes / best / (1 << 20));
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+        return parse_bench();
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+        fprintf(stderr, "usage: gmenu-parse [-b] [file ...]\n");
+        return 2;
+    }
+    int status = 0;
+    for (int i = 1; i < argc || i == 1; i++) {
+        const char *path = i < argc && strcmp(argv[i], "-") != 0 ? argv[i] : "/dev/stdin";
+        struct Mapping m;
+        if (!map_file(path, &m)) {
+            fprintf(stderr, "gmenu-parse: cannot open %s\n", path);
+            status = 1;
+            continue;
         }
-        if (!bg_cmd)
-            _exit(1);
-        LOG("Child process executing: %s", bg_cmd);
-        execl("/bin/sh", "sh", "-c", bg_cmd, (char *)NULL);
-        free(bg_cmd);
-        _exit(1);
+        if (fuzz_parse((const uint8_t *)m.data, m.len, path) > 0)
+            status = 1;
+        unmap_file(&m);
+        drain_log();
     }
+    return status;
 }
+#endif
+#endif